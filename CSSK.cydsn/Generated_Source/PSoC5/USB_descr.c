@@ -317,12 +317,12 @@ USB_HID_RPT_2_SIZE_MSB,
 /* REPORT_SIZE                             */ 0x75u, 0x08u, 
 /* INPUT                                   */ 0x81u, 0x01u, 
 /* LOGICAL_MINIMUM                         */ 0x15u, 0x00u, 
-/* LOGICAL_MAXIMUM                         */ 0x26u, 0xFFu, 0x00u, 
+/* LOGICAL_MAXIMUM                         */ 0x25u, 0x01u, 
 /* USAGE_MINIMUM                           */ 0x19u, 0x00u, 
-/* USAGE_MAXIMUM                           */ 0x2Au, 0xFFu, 0x00u, 
-/* REPORT_SIZE                             */ 0x75u, 0x08u, 
-/* REPORT_COUNT                            */ 0x95u, 0x3Eu, 
-/* INPUT                                   */ 0x81u, 0x00u, 
+/* USAGE_MAXIMUM                           */ 0x2Au, 0xDFu, 0x00u, 
+/* REPORT_SIZE                             */ 0x75u, 0x01u, 
+/* REPORT_COUNT                            */ 0x96u, 0xE0u, 0x00u, 
+/* INPUT                                   */ 0x81u, 0x02u, 
 /* USAGE_PAGE                              */ 0x05u, 0x08u, 
 /* USAGE_MINIMUM                           */ 0x19u, 0x01u, 
 /* USAGE_MAXIMUM                           */ 0x29u, 0x05u, 
@@ -13,7 +13,8 @@
  * pin assignment: direct order, aligned to the right of ADC.
  * for dual ADCs it means column X..11, X+12..23
  *
- * ODD NUMBER OF COLUMNS DO NOT MIX WITH DUAL ADCs!!! See scan.c!
+ * For dual ADCs set NUM_ADCs 2, and ADC0_COLUMNS/ADC1_COLUMNS if the split
+ * isn't even. See scan.h.
  */
 #define MATRIX_COLS 13
 #define MATRIX_ROWS 7
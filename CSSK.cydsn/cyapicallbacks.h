@@ -19,3 +19,5 @@
  * Help.*/
 #define USB_DP_ISR_ENTRY_CALLBACK
 void USB_DP_ISR_EntryCallback(void); // in PSoC_USB.c
+#define USB_SOF_ISR_ENTRY_CALLBACK
+void USB_SOF_ISR_EntryCallback(void); // in scan.c
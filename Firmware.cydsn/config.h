@@ -11,11 +11,15 @@
  * pin assignment: direct order, aligned to the right of ADC.
  * for dual ADCs it means column X..11, X+12..23
  *
- * ODD NUMBER OF COLUMNS DO NOT MIX WITH DUAL ADCs!!! See scan.c!
+ * For dual ADCs set NUM_ADCs 2, and ADC0_COLUMNS/ADC1_COLUMNS if the split
+ * isn't even. See scan.h.
  */
 #define MATRIX_COLS 16
 #define MATRIX_ROWS 8
 #define MATRIX_LAYERS 4
+// Fn keys a layer condition can name. Above 4 conditions are byte pairs and
+// the layer table is 256 entries, see pipeline.h
+#define LAYER_FN_KEYS 4
 
 // Switch type: BUCKLING_SPRING or BEAMSPRING
 #define SWITCH_TYPE BUCKLING_SPRING
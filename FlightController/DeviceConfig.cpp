@@ -1,6 +1,8 @@
 #include <QFile>
 #include <QFileDialog>
 #include <QMessageBox>
+#include <QTimerEvent>
+#include <algorithm>
 
 #include "DeviceConfig.h"
 #include "DeviceInterface.h"
@@ -11,32 +13,47 @@
 DeviceConfig::DeviceConfig(QObject *parent)
     : QObject(parent), bValid(false), numRows(0), numCols(0),
       numLayers(ABSOLUTE_MAX_LAYERS), numLayerConditions(NUM_LAYER_CONDITIONS),
-      numDelays(NUM_DELAYS), bNormallyLow(false),
-      transferDirection(TransferIdle) {
+      numDelays(NUM_DELAYS), bNormallyLow(false), bAdaptiveThresholds(false),
+      pressOffset(0), releaseOffset(0),
+      transferDirection(TransferIdle), transferTimerId(0) {
   memset(this->_eeprom.raw, 0x00, sizeof(this->_eeprom));
 }
 
+constexpr int kTransferTimeout = 500; // ms without progress before resending
+constexpr int kTransferRetries = 5;
+constexpr uint8_t kBulkBlocks = CONFIG_BULK_BLOCKS(EEPROM_BYTESIZE);
+
 bool DeviceConfig::eventFilter(QObject *obj __attribute__((unused)),
                                QEvent *event) {
   if (event->type() != DeviceMessage::ET)
     return false;
   QByteArray *payload = static_cast<DeviceMessage *>(event)->getPayload();
-  if (payload->at(0) != C2RESPONSE_CONFIG)
-    return false;
-
-  currentBlock++;
-  switch (transferDirection) {
-  case TransferDownload:
+  switch (payload->at(0)) {
+  case C2RESPONSE_CONFIG_BULK:
     _receiveConfigBlock(payload);
-    break;
-  case TransferUpload:
-    _uploadConfigBlock();
-    break;
+    return true;
+  case C2RESPONSE_CONFIG_ACK:
+    _receiveConfigAck(payload);
+    return true;
+  case C2RESPONSE_COMMIT: {
+    commit_result_t result;
+    memcpy(result.raw, payload->constData() + 1, sizeof result.raw);
+    qInfo() << "Written" << result.rowsWritten << "EEPROM rows in"
+            << result.micros / 1000 << "ms";
+    if (result.rowsFailed)
+      qWarning() << result.rowsFailed << "rows failed, commit again!";
+    return true;
+  }
   default:
-    qInfo() << "Received config block" << ((uint8_t)payload->at(1))
-            << "while supposed to be idle!";
+    return false;
   }
-  return true;
+}
+
+void DeviceConfig::timerEvent(QTimerEvent *timer) {
+  if (timer->timerId() != transferTimerId)
+    return;
+  qInfo() << "Config transfer stalled at block" << currentBlock;
+  _resendFrom(currentBlock);
 }
 
 /**
@@ -59,38 +76,28 @@ void DeviceConfig::toDevice(void) {
   this->_assemble();
   emit sendCommand(C2CMD_EWO, (1 << C2DEVSTATUS_SETUP_MODE));
   this->transferDirection = TransferUpload;
-  this->currentBlock = 0;
+  this->_startTransfer();
   qInfo() << "Uploading config..";
-  this->_uploadConfigBlock();
+  this->_uploadConfigWindow();
 }
 
 /**
- * @brief DeviceInterface::uploadConfigBlock
- * Upload one block to device.
- * We don't really care about the input packet here, hence (void)
+ * @brief DeviceConfig::_uploadConfigWindow
+ * Queue blocks until CONFIG_BULK_WINDOW of them are waiting for an ack -
+ * DeviceInterface sends each one only after the device answered the last.
  */
-void DeviceConfig::_uploadConfigBlock(void) {
-  switch (transferDirection) {
-  case TransferUpload:
-    if (currentBlock > (EEPROM_BYTESIZE / CONFIG_TRANSFER_BLOCK_SIZE)) {
-      qInfo() << "done!";
-      transferDirection = TransferIdle;
-      emit sendCommand(C2CMD_APPLY_CONFIG, 1);
-      return;
-    }
+void DeviceConfig::_uploadConfigWindow(void) {
+  while (nextBlock < kBulkBlocks &&
+         nextBlock < currentBlock + CONFIG_BULK_WINDOW) {
     qInfo(".");
-    OUT_c2packet_t msg;
-    msg.command = C2CMD_UPLOAD_CONFIG;
-    msg.payload[0] = currentBlock;
-    memcpy(msg.payload + CONFIG_BLOCK_DATA_OFFSET,
-           this->_eeprom.raw + (CONFIG_TRANSFER_BLOCK_SIZE * currentBlock),
-           CONFIG_TRANSFER_BLOCK_SIZE);
+    auto msg = OUT_c2packet_t();
+    msg.command = C2CMD_UPLOAD_CONFIG_BULK;
+    msg.payload[0] = nextBlock;
+    int offset = CONFIG_BULK_BLOCK_SIZE * nextBlock;
+    memcpy(msg.payload + 1, this->_eeprom.raw + offset,
+           std::min(CONFIG_BULK_BLOCK_SIZE, EEPROM_BYTESIZE - offset));
     emit(uploadBlock(msg));
-    break;
-  default:
-    qInfo() << "Not a good day to upload config block!";
-    QMessageBox::critical(NULL, "Not a good day to upload config block",
-                          "Error! Try pressing 'Reconnect' button!");
+    nextBlock++;
   }
 }
 
@@ -104,7 +111,7 @@ void DeviceConfig::fromDevice() {
   switch (transferDirection) {
   case TransferIdle:
     transferDirection = TransferDownload;
-    currentBlock = 0;
+    _startTransfer();
     qInfo() << "Downloading config..";
     break;
   case TransferDownload:
@@ -116,33 +123,142 @@ void DeviceConfig::fromDevice() {
                           "Error! Try pressing 'Reconnect' button!");
     return;
   }
-  emit(downloadBlock(C2CMD_DOWNLOAD_CONFIG, currentBlock));
+  emit(downloadBlock(C2CMD_DOWNLOAD_CONFIG_BULK, currentBlock));
 }
 
 /**
  * @brief DeviceInterface::_downloadConfigBlock
  * Receives one block from device, writes it to local config.
+ * Device streams the rest of config after the block asked for - one out of
+ * order means something got lost, so ask again from there.
  * @param payload - packet payload
  */
 void DeviceConfig::_receiveConfigBlock(QByteArray *payload) {
+  uint8_t block = payload->at(1);
   if (transferDirection != TransferDownload) {
-    qInfo() << "Not a good day to download config block!";
-    QMessageBox::critical(NULL, "Not a good day to download config blockb",
-                          "Error! Try pressing 'Reconnect' button!");
+    qInfo() << "Received config block" << block << "while supposed to be idle!";
     return;
   }
-  if (currentBlock >= (EEPROM_BYTESIZE / CONFIG_TRANSFER_BLOCK_SIZE)) {
-    transferDirection = TransferIdle;
+  if (block != currentBlock) {
+    if (block > currentBlock && !rewound) {
+      rewound = true;
+      emit(downloadBlock(C2CMD_DOWNLOAD_CONFIG_BULK, currentBlock));
+    }
+    return;
+  }
+  if (currentBlock >= kBulkBlocks)
+    return;
+  qInfo(".");
+  int offset = CONFIG_BULK_BLOCK_SIZE * currentBlock;
+  memcpy(this->_eeprom.raw + offset, payload->constData() + 2,
+         std::min(CONFIG_BULK_BLOCK_SIZE, EEPROM_BYTESIZE - offset));
+  currentBlock++;
+  _progress();
+}
+
+/**
+ * @brief DeviceConfig::_receiveConfigAck
+ * Cumulative ack - device has everything before ack.next, and its CRC
+ * must match ours.
+ */
+void DeviceConfig::_receiveConfigAck(QByteArray *payload) {
+  config_bulk_ack_t ack;
+  memcpy(ack.raw, payload->constData() + 1, sizeof ack.raw);
+  switch (transferDirection) {
+  case TransferUpload:
+    if (ack.next > nextBlock)
+      return;
+    if (ack.crc != _configCrc(ack.next)) {
+      qWarning() << "Config CRC mismatch at block" << ack.next;
+      _resendFrom(0);
+      return;
+    }
+    if (ack.next > currentBlock) {
+      currentBlock = ack.next;
+      _progress();
+    }
+    if (ack.rewind)
+      nextBlock = ack.next;
+    if (currentBlock == kBulkBlocks) {
+      qInfo() << "done!";
+      _stopTransfer();
+      emit sendCommand(C2CMD_APPLY_CONFIG, 1);
+      return;
+    }
+    _uploadConfigWindow();
+    break;
+  case TransferDownload:
+    if (currentBlock < kBulkBlocks) {
+      // Tail got lost. Unless already asked for again.
+      if (!rewound) {
+        rewound = true;
+        emit(downloadBlock(C2CMD_DOWNLOAD_CONFIG_BULK, currentBlock));
+      }
+      return;
+    }
+    if (ack.crc != _configCrc(kBulkBlocks)) {
+      qWarning() << "Config CRC mismatch";
+      _resendFrom(0);
+      return;
+    }
+    _stopTransfer();
     qInfo() << "done, unpacking...";
     _unpack();
+    break;
+  default:
+    qInfo() << "Received config ack while supposed to be idle!";
+  }
+}
+
+uint16_t DeviceConfig::_configCrc(uint8_t blocks) {
+  return config_crc(CONFIG_CRC_INIT, _eeprom.raw,
+                    std::min(CONFIG_BULK_BLOCK_SIZE * blocks, EEPROM_BYTESIZE));
+}
+
+void DeviceConfig::_startTransfer(void) {
+  currentBlock = 0;
+  nextBlock = 0;
+  retries = 0;
+  rewound = false;
+  _resetTransferTimer();
+}
+
+void DeviceConfig::_stopTransfer(void) {
+  transferDirection = TransferIdle;
+  if (transferTimerId)
+    killTimer(transferTimerId);
+  transferTimerId = 0;
+}
+
+void DeviceConfig::_resetTransferTimer(void) {
+  if (transferTimerId)
+    killTimer(transferTimerId);
+  transferTimerId = startTimer(kTransferTimeout);
+}
+
+void DeviceConfig::_progress(void) {
+  retries = 0;
+  rewound = false;
+  _resetTransferTimer();
+}
+
+void DeviceConfig::_resendFrom(uint8_t block) {
+  if (++retries > kTransferRetries) {
+    qWarning() << "Config transfer failed!";
+    _stopTransfer();
+    QMessageBox::critical(NULL, "Config transfer failed",
+                          "Error! Try pressing 'Reconnect' button!");
     return;
   }
-  qInfo(".");
-  memcpy(this->_eeprom.raw +
-             (CONFIG_TRANSFER_BLOCK_SIZE * (uint8_t)payload->at(1)),
-         payload->data() + 1 + CONFIG_BLOCK_DATA_OFFSET,
-         CONFIG_TRANSFER_BLOCK_SIZE);
-  emit(downloadBlock(C2CMD_DOWNLOAD_CONFIG, currentBlock));
+  currentBlock = block;
+  nextBlock = block;
+  rewound = false;
+  _resetTransferTimer();
+  if (transferDirection == TransferUpload) {
+    _uploadConfigWindow();
+  } else {
+    emit(downloadBlock(C2CMD_DOWNLOAD_CONFIG_BULK, block));
+  }
 }
 
 void DeviceConfig::_unpack(void) {
@@ -150,6 +266,9 @@ void DeviceConfig::_unpack(void) {
   numCols = _eeprom.matrixCols;
   numLayers = _eeprom.matrixLayers;
   bNormallyLow = _eeprom.capsenseFlags & (1 << CSF_NL);
+  bAdaptiveThresholds = _eeprom.capsenseFlags & (1 << CSF_ADAPTIVE);
+  pressOffset = _eeprom.pressOffset;
+  releaseOffset = _eeprom.releaseOffset;
   memset(thresholds, EMPTY_FLASH_BYTE, sizeof(thresholds));
   memset(layouts, 0x00, sizeof(layouts));
   uint8_t tableSize = numRows * numCols;
@@ -184,7 +303,6 @@ void DeviceConfig::_unpack(void) {
 void DeviceConfig::_assemble(void) {
   _eeprom.configVersion = 2;
   memset(_eeprom.stash, EMPTY_FLASH_BYTE, sizeof(_eeprom.stash));
-  memset(_eeprom._RESERVED0, EMPTY_FLASH_BYTE, sizeof(_eeprom._RESERVED0));
   memset(_eeprom._RESERVED1, EMPTY_FLASH_BYTE, sizeof(_eeprom._RESERVED1));
   uint8_t tableSize = numRows * numCols;
   for (uint8_t i = 0; i < this->numRows; i++) {
@@ -306,6 +424,18 @@ HardwareConfig DeviceConfig::getHardwareConfig(void) {
   retval.chargeDelay = _eeprom.chargeDelay;
   retval.dischargeDelay = _eeprom.dischargeDelay;
   retval.debouncingTicks = _eeprom.debouncingTicks;
+  retval.filterDepth =
+      _eeprom.filterDepth > MAX_FILTER_DEPTH ? 0 : _eeprom.filterDepth;
+  retval.adaptiveThresholds = _eeprom.capsenseFlags & (1 << CSF_ADAPTIVE);
+  retval.pressOffset = _eeprom.pressOffset;
+  retval.releaseOffset = _eeprom.releaseOffset;
+  retval.eagerPress = _eeprom.capsenseFlags & (1 << CSF_EAGER);
+  retval.eagerLockout = _eeprom.eagerLockout == EMPTY_FLASH_BYTE
+                            ? DEFAULT_EAGER_LOCKOUT
+                            : std::min<uint8_t>(_eeprom.eagerLockout,
+                                                MAX_EAGER_LOCKOUT);
+  retval.coalesceEvents = _eeprom.capsenseFlags & (1 << CSF_COALESCE);
+  retval.sofAlign = _eeprom.capsenseFlags & (1 << CSF_SOF_ALIGN);
   retval.expHdrMode = _eeprom.expMode;
   retval.expHdrParam1 = _eeprom.expParam1;
   retval.expHdrParam2 = _eeprom.expParam2;
@@ -317,6 +447,28 @@ void DeviceConfig::setHardwareConfig(HardwareConfig config) {
   _eeprom.chargeDelay = config.chargeDelay;
   _eeprom.dischargeDelay = config.dischargeDelay;
   _eeprom.debouncingTicks = config.debouncingTicks;
+  _eeprom.filterDepth = config.filterDepth;
+  _eeprom.capsenseFlags &=
+      ~((1 << CSF_ADAPTIVE) | (1 << CSF_EAGER) | (1 << CSF_COALESCE) |
+        (1 << CSF_SOF_ALIGN));
+  if (config.adaptiveThresholds) {
+    _eeprom.capsenseFlags |= (1 << CSF_ADAPTIVE);
+  }
+  if (config.eagerPress) {
+    _eeprom.capsenseFlags |= (1 << CSF_EAGER);
+  }
+  _eeprom.eagerLockout = config.eagerLockout;
+  if (config.coalesceEvents) {
+    _eeprom.capsenseFlags |= (1 << CSF_COALESCE);
+  }
+  if (config.sofAlign) {
+    _eeprom.capsenseFlags |= (1 << CSF_SOF_ALIGN);
+  }
+  _eeprom.pressOffset = config.pressOffset;
+  _eeprom.releaseOffset = config.releaseOffset;
+  bAdaptiveThresholds = config.adaptiveThresholds;
+  pressOffset = config.pressOffset;
+  releaseOffset = config.releaseOffset;
   _eeprom.expMode = config.expHdrMode;
   _eeprom.expParam1 = config.expHdrParam1;
   _eeprom.expParam2 = config.expHdrParam2;
@@ -12,6 +12,14 @@ struct HardwareConfig {
   uint8_t chargeDelay;
   uint16_t dischargeDelay;
   uint8_t debouncingTicks;
+  uint8_t filterDepth;
+  bool adaptiveThresholds;
+  uint8_t pressOffset;
+  uint8_t releaseOffset;
+  bool eagerPress;
+  uint8_t eagerLockout;
+  bool coalesceEvents;
+  bool sofAlign;
   uint8_t expHdrMode;
   uint8_t expHdrParam1;
   uint8_t expHdrParam2;
@@ -31,6 +39,9 @@ public:
   uint8_t numLayerConditions;
   uint8_t numDelays;
   bool bNormallyLow;
+  bool bAdaptiveThresholds;
+  uint8_t pressOffset;
+  uint8_t releaseOffset;
   uint8_t guardHi;
   uint8_t guardLo;
   uint8_t thresholds[ABSOLUTE_MAX_ROWS][ABSOLUTE_MAX_COLS];
@@ -60,13 +71,25 @@ public slots:
 
 protected:
   bool eventFilter(QObject *obj, QEvent *event);
+  void timerEvent(QTimerEvent *);
 
 private:
   psoc_eeprom_t _eeprom;
   enum TransferDirection transferDirection;
-  uint8_t currentBlock;
-  void _uploadConfigBlock(void);
+  uint8_t currentBlock; // first block not acked
+  uint8_t nextBlock;    // first block not sent, upload only
+  int transferTimerId;
+  int retries;
+  bool rewound; // asked to resend, ignoring the rest until it comes
+  void _uploadConfigWindow(void);
   void _receiveConfigBlock(QByteArray *);
+  void _receiveConfigAck(QByteArray *);
+  uint16_t _configCrc(uint8_t blocks);
+  void _startTransfer(void);
+  void _stopTransfer(void);
+  void _resetTransferTimer(void);
+  void _progress(void);
+  void _resendFrom(uint8_t block);
   void _unpack(void);
   void _assemble(void);
 };
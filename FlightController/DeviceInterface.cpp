@@ -53,6 +53,9 @@ void DeviceInterface::processStatusReply(QByteArray* payload) {
   qInfo().nospace().noquote() << "CommonSense " << firmwareVersion
                     << ", die temp " << (payload->at(4) == 1 ? '+' : '-')
                     << (uint8_t)payload->at(5) << "C";
+  uint32_t eagerGlitches;
+  memcpy(&eagerGlitches, payload->constData() + 6, sizeof(eagerGlitches));
+  qInfo().nospace() << "Eager presses that were glitches: " << eagerGlitches;
   qInfo().nospace() << "Scan: " << scanEnabled
       << ", Output: " << outputEnabled
       << ", Monitor: " << matrixMonitor
@@ -88,6 +91,10 @@ bool DeviceInterface::event(QEvent *e) {
       qInfo().noquote() << QString((flags & flagReleased) ? " r" : "p")
                         << row + 1 << col + 1;
       return true;
+    case C2RESPONSE_LOG:
+      for (const QString &line : LogViewer::formatDeviceLog(payload))
+        qInfo().noquote() << line;
+      return true;
     default:
       qInfo() << payload->constData();
       return true;
@@ -219,6 +226,8 @@ void DeviceInterface::_sendPacket() {
   if (commandQueue_.empty()) {
     return;
   }
+  // Device has a single SET_REPORT buffer - even config upload waits for
+  // CTS, see CONFIG_BULK_WINDOW.
   if (!cts_.exchange(false) && noCtsDelay_) {
     --noCtsDelay_;
     return;
@@ -47,6 +47,8 @@ FlightController::FlightController(QWidget *parent)
 
   _hardware = new Hardware(di.config);
 
+  _performance = new Performance();
+
   // Must be last in chain to intercept all packets!
   loader = new FirmwareLoader();
   connect(loader, SIGNAL(switchMode(bool)), &di, SLOT(bootloaderMode(bool)));
@@ -96,6 +98,10 @@ void FlightController::setup(void) {
   connect(ui->action_Hardware, SIGNAL(triggered()), this,
           SLOT(editHardware()));
 
+  connect(ui->perfButton, SIGNAL(clicked()), this, SLOT(showPerformance()));
+  connect(ui->action_Performance, SIGNAL(triggered()), this,
+          SLOT(showPerformance()));
+
   connect(ui->BootloaderButton, SIGNAL(clicked()), loader, SLOT(start()));
   connect(ui->action_Update_Firmware, SIGNAL(triggered()), loader,
           SLOT(start()));
@@ -254,6 +260,7 @@ void FlightController::lockUI(bool lock) {
   ui->layerModsButton->setDisabled(lock);
   ui->delaysButton->setDisabled(lock);
   ui->hwButton->setDisabled(lock);
+  ui->perfButton->setDisabled(lock);
 }
 
 void FlightController::editLayoutClick(void) {
@@ -284,6 +291,8 @@ void FlightController::editHardware() {
   _hardware->raise();
 }
 
+void FlightController::showPerformance() { _performance->show(); }
+
 void FlightController::on_scanButton_clicked() {
   emit flipStatusBit(C2DEVSTATUS_SCAN_ENABLED);
 }
@@ -19,6 +19,7 @@
 #include "LayerConditions.h"
 #include "LayoutEditor.h"
 #include "MatrixMonitor.h"
+#include "Performance.h"
 #include "ThresholdEditor.h"
 #include "MacroEditor.h"
 
@@ -64,6 +65,7 @@ private:
   LayerConditions *layerConditions;
   Delays *_delays;
   Hardware *_hardware;
+  Performance *_performance;
   FirmwareLoader *loader;
   QtMessageHandler *_oldLogger;
   bool _uiLocked = false;
@@ -84,4 +86,5 @@ private slots:
   void on_reconnectButton_clicked(void);
   void editDelays(void);
   void editHardware(void);
+  void showPerformance(void);
 };
@@ -44,7 +44,8 @@ SOURCES += main.cpp \
     Delays.cpp \
     Hardware.cpp \
     Macro.cpp \
-    DeviceSelector.cpp
+    DeviceSelector.cpp \
+    Performance.cpp
 
 HEADERS  += \
     ../c2/c2_protocol.h \
@@ -69,7 +70,8 @@ HEADERS  += \
     Delays.h \
     Hardware.h \
     Macro.h \
-    DeviceSelector.h
+    DeviceSelector.h \
+    Performance.h
 
 FORMS    += \
     FlightController.ui \
@@ -78,6 +80,7 @@ FORMS    += \
     ThresholdEditor.ui \
     MacroEditor.ui \
     Hardware.ui \
-    DeviceSelector.ui
+    DeviceSelector.ui \
+    Performance.ui
 
 DISTFILES +=
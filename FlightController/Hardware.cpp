@@ -30,6 +30,14 @@ void Hardware::init() {
   ui->chargeDelay->setValue(config.chargeDelay);
   ui->dischargeDelay->setValue(config.dischargeDelay);
   ui->debouncingTicks->setValue(config.debouncingTicks);
+  ui->filterDepth->setValue(config.filterDepth);
+  ui->adaptiveThresholds->setChecked(config.adaptiveThresholds);
+  ui->pressOffset->setValue(config.pressOffset);
+  ui->releaseOffset->setValue(config.releaseOffset);
+  ui->eagerPress->setChecked(config.eagerPress);
+  ui->eagerLockout->setValue(config.eagerLockout);
+  ui->coalesceEvents->setChecked(config.coalesceEvents);
+  ui->sofAlign->setChecked(config.sofAlign);
   ui->modeBox->setCurrentIndex(config.expHdrMode);
   ui->Param1->setValue(config.expHdrParam1);
   ui->Param2->setValue(config.expHdrParam2);
@@ -65,6 +73,14 @@ void Hardware::on_applyButton_clicked(void) {
   config.chargeDelay = ui->chargeDelay->value();
   config.dischargeDelay = ui->dischargeDelay->value();
   config.debouncingTicks = ui->debouncingTicks->value();
+  config.filterDepth = ui->filterDepth->value();
+  config.adaptiveThresholds = ui->adaptiveThresholds->isChecked();
+  config.pressOffset = ui->pressOffset->value();
+  config.releaseOffset = ui->releaseOffset->value();
+  config.eagerPress = ui->eagerPress->isChecked();
+  config.eagerLockout = ui->eagerLockout->value();
+  config.coalesceEvents = ui->coalesceEvents->isChecked();
+  config.sofAlign = ui->sofAlign->isChecked();
   config.expHdrMode = ui->modeBox->currentIndex();
   config.expHdrParam1 = ui->Param1->value();
   config.expHdrParam2 = ui->Param2->value();
@@ -7,12 +7,50 @@
  * published by the Free Software Foundation.
  */
 #include "LogViewer.h"
+#include "../c2/c2_protocol.h"
 #include <QMessageBox>
 
 LogViewer::LogViewer(QWidget *parent) : QPlainTextEdit(parent) {
   this->setReadOnly(true);
 }
 
+/**
+ * @brief LogViewer::formatDeviceLog
+ * Device only sends message IDs and raw arguments - see LOG_MESSAGES.
+ * @param payload - C2RESPONSE_LOG packet
+ */
+QStringList LogViewer::formatDeviceLog(const QByteArray *payload) {
+  QStringList lines;
+  const uint8_t *log = (const uint8_t *)payload->constData() + 1;
+  int size = payload->size() - 1;
+  if (log[0])
+    lines << QString("Device lost %1 log messages").arg(log[0]);
+  int pos = 2;
+  for (uint8_t i = 0; i < log[1]; i++) {
+    if (pos + LOG_RECORD_HEADER > size) {
+      lines << "Garbled device log";
+      break;
+    }
+    uint8_t id = log[pos];
+    uint8_t argc = log[pos + 1];
+    uint32_t args[LOG_MAX_ARGS] = {0};
+    int len = LOG_RECORD_HEADER + argc * sizeof(uint32_t);
+    if (argc > LOG_MAX_ARGS || pos + len > size) {
+      lines << "Garbled device log";
+      break;
+    }
+    memcpy(args, log + pos + LOG_RECORD_HEADER, argc * sizeof(uint32_t));
+    pos += len;
+    if (id >= LOG_MESSAGE_COUNT) {
+      lines << QString("Unknown device log message %1").arg(id);
+      continue;
+    }
+    lines << QString::asprintf(logFormats[id], args[0], args[1], args[2],
+                               args[3], args[4]);
+  }
+  return lines;
+}
+
 void LogViewer::logMessage(QString msg) {
   this->appendPlainText(msg);
   repaint();
@@ -9,12 +9,14 @@
 #pragma once
 
 #include <QPlainTextEdit>
+#include <QStringList>
 
 class LogViewer : public QPlainTextEdit {
   Q_OBJECT
 
 public:
   LogViewer(QWidget *parent = NULL);
+  static QStringList formatDeviceLog(const QByteArray *payload);
 
 public slots:
   void clearButtonClick(void);
@@ -62,7 +62,7 @@ void MatrixMonitor::initDisplay(void) {
       ll->setSpacing(0);
       w->setLayout(ll);
 
-      QLCDNumber *l = new QLCDNumber(3);
+      QLCDNumber *l = new QLCDNumber(4); // 12-bit readouts
       l->setSegmentStyle(QLCDNumber::Filled);
       l->setMinimumHeight(25);
       display[i][j] = l;
@@ -98,47 +98,120 @@ bool MatrixMonitor::eventFilter(QObject *obj __attribute__((unused)),
                                 QEvent *event) {
   if (event->type() == DeviceMessage::ET) {
     QByteArray *pl = static_cast<DeviceMessage *>(event)->getPayload();
-    if (pl->at(0) != C2RESPONSE_MATRIX_ROW)
-      return false;
-    if (_warmupRows > 0) {
-      _warmupRows--;
+    if (pl->at(0) == C2RESPONSE_BASELINE_ROW) {
+      _receiveBaselineRow(pl);
+      return true;
+    }
+    if (pl->at(0) == C2RESPONSE_MATRIX_TELEMETRY) {
+      _receiveTelemetry(pl);
       return true;
     }
-    uint8_t row = pl->at(1);
-    uint8_t max_cols = pl->at(2);
-    for (uint8_t i = 0; i < max_cols; i++) {
-      QLCDNumber *cell = display[row][i];
-      uint8_t level = pl->constData()[3 + i];
-      if ((!deviceConfig->bNormallyLow &&
-           level > deviceConfig->thresholds[row][i]) ||
-          (deviceConfig->bNormallyLow &&
-           level < deviceConfig->thresholds[row][i])) {
-        cell->setStyleSheet("background-color: #ffffff;");
-      } else {
-        cell->setStyleSheet("background-color: #ffff33;");
+  }
+  return false;
+}
+
+/*
+ * Unpacks records from telemetry stream - see C2RESPONSE_MATRIX_TELEMETRY.
+ * Deltas are only meaningful once absolute values for the row came in.
+ */
+void MatrixMonitor::_receiveTelemetry(QByteArray *pl) {
+  const uint8_t *p = (const uint8_t *)pl->constData() + 2;
+  const uint8_t *end = (const uint8_t *)pl->constData() + pl->size();
+  uint8_t cols = deviceConfig->numCols;
+  for (uint8_t r = 0; r < (uint8_t)pl->at(1); r++) {
+    if (p >= end)
+      break;
+    uint8_t row = *p & ~MATRIX_TELEMETRY_ABSOLUTE;
+    bool absolute = *p++ & MATRIX_TELEMETRY_ABSOLUTE;
+    uint8_t size = absolute ? MATRIX_TELEMETRY_ABSOLUTE_BYTES(cols)
+                            : MATRIX_TELEMETRY_DELTA_BYTES(cols);
+    if (row >= ABSOLUTE_MAX_ROWS || p + size > end) {
+      qWarning() << "Malformed matrix telemetry";
+      break;
+    }
+    if (absolute) {
+      for (uint8_t i = 0; i < cols; i++) {
+        const uint8_t *pair = &p[i / 2 * 3];
+        _streamed[row][i] = (i & 1) ? (pair[1] >> 4) | (pair[2] << 4)
+                                    : pair[0] | ((pair[1] & 0x0f) << 8);
       }
-      _updateStatCell(row, i, level);
-      switch (displayMode) {
-      case DisplayNow:
-        cell->display(cells[row][i].now);
-        break;
-      case DisplayMin:
-        cell->display(cells[row][i].min);
-        break;
-      case DisplayMax:
-        cell->display(cells[row][i].max);
-        break;
-      case DisplayAvg:
-        cell->display((uint8_t)(cells[row][i].sum / cells[row][i].sampleCount));
-        break;
-      default:
-        qCritical() << "Unknown display mode selected!!";
-        close();
+      _haveRow[row] = true;
+    } else {
+      for (uint8_t i = 0; i < cols; i++) {
+        int8_t delta = (p[i / 2] >> ((i & 1) * 4)) & 0x0f;
+        if (delta & 0x08)
+          delta -= 0x10;
+        _streamed[row][i] = (_streamed[row][i] + delta) & MATRIX_TELEMETRY_MAX;
       }
     }
-    return true;
+    p += size;
+    if (!_haveRow[row])
+      continue;
+    if (_warmupRows > 0) {
+      _warmupRows--;
+      continue;
+    }
+    for (uint8_t i = 0; i < cols; i++) {
+      _updateCell(row, i, _streamed[row][i]);
+    }
+  }
+}
+
+void MatrixMonitor::_updateCell(uint8_t row, uint8_t col, uint16_t level) {
+  QLCDNumber *cell = display[row][col];
+  // Firmware thresholds only look at the low byte.
+  if (_isPressed(row, col, level & 0xff)) {
+    cell->setStyleSheet("background-color: #ffff33;");
+  } else {
+    cell->setStyleSheet("background-color: #ffffff;");
+  }
+  _updateStatCell(row, col, level);
+  switch (displayMode) {
+  case DisplayNow:
+    cell->display(cells[row][col].now);
+    break;
+  case DisplayMin:
+    cell->display(cells[row][col].min);
+    break;
+  case DisplayMax:
+    cell->display(cells[row][col].max);
+    break;
+  case DisplayAvg:
+    cell->display((int)(cells[row][col].sum / cells[row][col].sampleCount));
+    break;
+  case DisplayBaseline:
+    cell->display(cells[row][col].baseline);
+    break;
+  default:
+    qCritical() << "Unknown display mode selected!!";
+    close();
+  }
+}
+
+/*
+ * Adaptive thresholds - firmware compares against tracked baseline,
+ * which trickles in as separate packets in between telemetry.
+ */
+bool MatrixMonitor::_isPressed(uint8_t row, uint8_t col, uint16_t level) {
+  if (deviceConfig->bAdaptiveThresholds) {
+    int base = cells[row][col].baseline;
+    if (deviceConfig->bNormallyLow) {
+      return level > base + deviceConfig->pressOffset;
+    }
+    return level < base - deviceConfig->pressOffset;
+  }
+  if (deviceConfig->bNormallyLow) {
+    return level > deviceConfig->thresholds[row][col];
+  }
+  return level < deviceConfig->thresholds[row][col];
+}
+
+void MatrixMonitor::_receiveBaselineRow(QByteArray *pl) {
+  uint8_t row = pl->at(1);
+  uint8_t max_cols = pl->at(2);
+  for (uint8_t i = 0; i < max_cols; i++) {
+    cells[row][i].baseline = pl->constData()[3 + i];
   }
-  return false;
 }
 
 void MatrixMonitor::enableTelemetry(uint8_t m) {
@@ -159,7 +232,7 @@ void MatrixMonitor::on_setThresholdsButton_clicked() {
     return;
   for (uint8_t i = 0; i < deviceConfig->numRows; i++) {
     for (uint8_t j = 0; j < deviceConfig->numCols; j++) {
-      deviceConfig->thresholds[i][j] = display[i][j]->intValue();
+      deviceConfig->thresholds[i][j] = std::min(display[i][j]->intValue(), 255);
     }
   }
 }
@@ -180,6 +253,8 @@ void MatrixMonitor::on_modeBox_currentTextChanged(QString newValue) {
     displayMode = DisplayMax;
   else if (newValue == "Avg")
     displayMode = DisplayAvg;
+  else if (newValue == "Baseline")
+    displayMode = DisplayBaseline;
   else
     qCritical() << "Unknown display mode selected!!";
 }
@@ -188,16 +263,19 @@ void MatrixMonitor::_resetCells() {
   for (uint8_t i = 0; i < ABSOLUTE_MAX_ROWS; i++) {
     for (uint8_t j = 0; j < ABSOLUTE_MAX_COLS; j++) {
       cells[i][j] = {
-          .now = 0, .min = 255, .max = 0, .sum = 0, .sampleCount = 0};
+          .now = 0, .min = 0xffff, .max = 0, .sum = 0, .sampleCount = 0,
+          .baseline = 0};
       _updateStatCellDisplay(i, j);
       display[i][j]->display(0);
     }
+    _haveRow[i] = false;
   }
   _warmupRows = ABSOLUTE_MAX_ROWS; // Workaround - stale data may come in couple
                                    // of first rows.
 }
 
-void MatrixMonitor::_updateStatCell(uint8_t row, uint8_t col, uint8_t level) {
+void MatrixMonitor::_updateStatCell(uint8_t row, uint8_t col,
+                                    uint16_t level) {
   cells[row][col].now = level;
   cells[row][col].min = std::min(level, cells[row][col].min);
   cells[row][col].max = std::max(level, cells[row][col].max);
@@ -234,7 +312,7 @@ void MatrixMonitor::on_exportButton_clicked(void) {
     QFile f(fns.at(0));
     f.open(QIODevice::WriteOnly);
     QTextStream ts(&f);
-    ts << "Row,Col,Min,Max,Avg,Sum,Count\n";
+    ts << "Row,Col,Min,Max,Avg,Sum,Count,Baseline\n";
     ts.setIntegerBase(10);
     for (uint8_t i = 0; i < deviceConfig->numRows; i++) {
       QByteArray buf;
@@ -245,7 +323,8 @@ void MatrixMonitor::on_exportButton_clicked(void) {
           ts << cells[i][j].sum / cells[i][j].sampleCount << ",";
         else
           ts << "0,";
-        ts << cells[i][j].sum << "," << cells[i][j].sampleCount << "\n";
+        ts << cells[i][j].sum << "," << cells[i][j].sampleCount << ",";
+        ts << cells[i][j].baseline << "\n";
       }
     }
     f.close();
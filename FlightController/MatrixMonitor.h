@@ -14,11 +14,12 @@ class MatrixMonitor;
 }
 
 typedef struct {
-  uint8_t now;
-  uint8_t min;
-  uint8_t max;
+  uint16_t now;
+  uint16_t min;
+  uint16_t max;
   uint32_t sum;
   uint32_t sampleCount;
+  uint8_t baseline;
 } MonitoredCell;
 
 class MatrixMonitor : public QFrame {
@@ -28,7 +29,13 @@ public:
   explicit MatrixMonitor(QWidget *parent = 0);
   ~MatrixMonitor();
   void show(void);
-  enum DisplayMode { DisplayNow, DisplayMin, DisplayMax, DisplayAvg };
+  enum DisplayMode {
+    DisplayNow,
+    DisplayMin,
+    DisplayMax,
+    DisplayAvg,
+    DisplayBaseline
+  };
   Q_ENUM(DisplayMode);
 
 signals:
@@ -48,13 +55,19 @@ private:
   QLabel *statsDisplay[ABSOLUTE_MAX_ROWS][ABSOLUTE_MAX_COLS];
   DeviceConfig *deviceConfig;
   uint8_t _warmupRows;
+  bool _haveRow[ABSOLUTE_MAX_ROWS]; // Got absolute values, deltas apply.
+  uint16_t _streamed[ABSOLUTE_MAX_ROWS][ABSOLUTE_MAX_COLS];
 
   void initDisplay(void);
   void updateDisplaySize(uint8_t, uint8_t);
   void enableTelemetry(uint8_t);
   void _resetCells();
-  void _updateStatCell(uint8_t row, uint8_t col, uint8_t level);
+  void _updateCell(uint8_t row, uint8_t col, uint16_t level);
+  void _updateStatCell(uint8_t row, uint8_t col, uint16_t level);
   void _updateStatCellDisplay(uint8_t row, uint8_t col);
+  bool _isPressed(uint8_t row, uint8_t col, uint16_t level);
+  void _receiveBaselineRow(QByteArray *pl);
+  void _receiveTelemetry(QByteArray *pl);
 
 private slots:
   void on_runButton_clicked(void);
@@ -0,0 +1,201 @@
+#include <QCloseEvent>
+#include <QFile>
+#include <QFileDialog>
+#include <QSettings>
+#include <QTextStream>
+
+#include "DeviceInterface.h"
+#include "Events.h"
+#include "Performance.h"
+#include "settings.h"
+#include "singleton.h"
+#include "ui_Performance.h"
+
+constexpr int kPerfPollInterval = 1000;
+
+Performance::Performance(QWidget *parent)
+    : QFrame(parent), ui(new Ui::Performance), _pollTimerId(0) {
+  ui->setupUi(this);
+  memset(_latency, 0, sizeof(_latency));
+  ui->latencyTable->setRowCount(LATENCY_BUCKETS);
+  ui->latencyTable->setColumnCount(LATENCY_STAGES);
+  QStringList stages;
+  for (uint8_t i = 0; i < LATENCY_STAGES; i++) {
+    stages << latencyStageNames[i];
+  }
+  ui->latencyTable->setHorizontalHeaderLabels(stages);
+  QStringList buckets;
+  for (uint8_t i = 0; i < LATENCY_BUCKETS; i++) {
+    buckets << _bucketName(i);
+  }
+  ui->latencyTable->setVerticalHeaderLabels(buckets);
+  _showLatency();
+  DeviceInterface &di = Singleton<DeviceInterface>::instance();
+  connect(this, SIGNAL(sendCommand(c2command, uint8_t)), &di,
+          SLOT(sendCommand(c2command, uint8_t)));
+  di.installEventFilter(this);
+}
+
+Performance::~Performance() { delete ui; }
+
+void Performance::show(void) {
+  if (!_pollTimerId) {
+    _pollTimerId = startTimer(kPerfPollInterval);
+  }
+  emit sendCommand(C2CMD_GET_PERF_COUNTERS, 0);
+  emit sendCommand(C2CMD_GET_LATENCY, LATENCY_PICKUP);
+  QWidget::show();
+  QWidget::raise();
+}
+
+void Performance::closeEvent(QCloseEvent *event) {
+  if (_pollTimerId) {
+    killTimer(_pollTimerId);
+    _pollTimerId = 0;
+  }
+  event->accept();
+}
+
+void Performance::timerEvent(QTimerEvent *timer) {
+  if (timer->timerId() == _pollTimerId) {
+    emit sendCommand(C2CMD_GET_PERF_COUNTERS, 0);
+    // Rest of the stages are asked for as answers come in.
+    emit sendCommand(C2CMD_GET_LATENCY, LATENCY_PICKUP);
+  }
+}
+
+bool Performance::eventFilter(QObject *obj __attribute__((unused)),
+                              QEvent *event) {
+  if (event->type() != DeviceMessage::ET) {
+    return false;
+  }
+  QByteArray *pl = static_cast<DeviceMessage *>(event)->getPayload();
+  switch (pl->at(0)) {
+  case C2RESPONSE_PERF_COUNTERS: {
+    perf_counters_t counters;
+    memcpy(counters.raw, pl->constData() + 1, sizeof(counters.raw));
+    _showCounters(counters);
+    return true;
+  }
+  case C2RESPONSE_LATENCY: {
+    latency_histogram_t histogram;
+    memcpy(histogram.raw, pl->constData() + 1, sizeof(histogram.raw));
+    _receiveLatency(histogram);
+    return true;
+  }
+  default:
+    return false;
+  }
+}
+
+void Performance::_showCounters(const perf_counters_t &counters) {
+  ui->passesValue->setText(QString::number(counters.passesPerSecond));
+  if (counters.isrMinCycles > counters.isrMaxCycles) {
+    // No Result_ISR since last readout - scan is stopped.
+    ui->isrMinValue->setText("-");
+    ui->isrMaxValue->setText("-");
+  } else {
+    ui->isrMinValue->setText(QString::number(counters.isrMinCycles));
+    ui->isrMaxValue->setText(QString::number(counters.isrMaxCycles));
+  }
+  ui->isrAvgValue->setText(QString::number(counters.isrAvgCycles));
+  ui->scancodeHighWaterValue->setText(
+      QString::number(counters.scancodeHighWater));
+  ui->scancodeOverwritesValue->setText(
+      QString::number(counters.scancodeOverwrites));
+  ui->usbQueueValue->setText(QString("%1 (max %2, dropped %3)")
+                                 .arg(counters.usbQueueNow)
+                                 .arg(counters.usbQueueHighWater)
+                                 .arg(counters.usbQueueOverflows));
+  ui->keymapValue->setText(QString::number(counters.keymapMaxCycles));
+  ui->macroOverflowsValue->setText(QString::number(counters.macroOverflows));
+  ui->c2OverflowsValue->setText(QString::number(counters.c2Overflows));
+  ui->sofPhaseValue->setText(QString("%1/%2")
+                                 .arg(counters.sofPhaseAvg)
+                                 .arg(counters.sofPhaseMax));
+}
+
+void Performance::_receiveLatency(const latency_histogram_t &histogram) {
+  if (histogram.stage >= LATENCY_STAGES) {
+    return;
+  }
+  for (uint8_t i = 0; i < LATENCY_BUCKETS; i++) {
+    _latency[histogram.stage][i] += histogram.counts[i];
+  }
+  if (histogram.stage + 1 < LATENCY_STAGES) {
+    emit sendCommand(C2CMD_GET_LATENCY, histogram.stage + 1);
+  } else {
+    _showLatency();
+  }
+}
+
+void Performance::_showLatency(void) {
+  for (uint8_t stage = 0; stage < LATENCY_STAGES; stage++) {
+    quint64 total = 0;
+    for (uint8_t i = 0; i < LATENCY_BUCKETS; i++) {
+      total += _latency[stage][i];
+    }
+    for (uint8_t i = 0; i < LATENCY_BUCKETS; i++) {
+      QString text = "-";
+      if (_latency[stage][i]) {
+        text = QString("%1 (%2%)")
+                   .arg(_latency[stage][i])
+                   .arg(100.0 * _latency[stage][i] / total, 0, 'f', 1);
+      }
+      QTableWidgetItem *item = new QTableWidgetItem(text);
+      item->setTextAlignment(Qt::AlignRight | Qt::AlignVCenter);
+      ui->latencyTable->setItem(i, stage, item);
+    }
+  }
+}
+
+QString Performance::_bucketName(uint8_t bucket) {
+  if (bucket == 0) {
+    return QString("0us");
+  }
+  uint32_t low = 1 << (bucket - 1);
+  if (bucket == LATENCY_BUCKETS - 1) {
+    return QString("%1us+").arg(low);
+  }
+  if (bucket == 1) {
+    return QString("1us");
+  }
+  return QString("%1-%2us").arg(low).arg((low << 1) - 1);
+}
+
+void Performance::on_clearButton_clicked(void) {
+  memset(_latency, 0, sizeof(_latency));
+  _showLatency();
+}
+
+void Performance::on_exportButton_clicked(void) {
+  QSettings settings;
+  QFileDialog fd(Q_NULLPTR, "Choose one file to export to");
+  fd.setDirectory(settings.value(SETTINGS_DIR_KEY).toString());
+  fd.setNameFilter(tr("Latency histograms(*.csv)"));
+  fd.setDefaultSuffix(QString("csv"));
+  fd.setAcceptMode(QFileDialog::AcceptSave);
+  if (fd.exec()) {
+    QStringList fns = fd.selectedFiles();
+    QFile f(fns.at(0));
+    f.open(QIODevice::WriteOnly);
+    QTextStream ts(&f);
+    ts << "From us,To us";
+    for (uint8_t stage = 0; stage < LATENCY_STAGES; stage++) {
+      ts << "," << latencyStageNames[stage];
+    }
+    ts << "\n";
+    for (uint8_t i = 0; i < LATENCY_BUCKETS; i++) {
+      // Open-ended last bucket has empty upper bound.
+      ts << (i ? 1u << (i - 1) : 0) << ",";
+      if (i < LATENCY_BUCKETS - 1) {
+        ts << ((1u << i) - 1);
+      }
+      for (uint8_t stage = 0; stage < LATENCY_STAGES; stage++) {
+        ts << "," << _latency[stage][i];
+      }
+      ts << "\n";
+    }
+    f.close();
+  }
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <QFrame>
+
+#include "../c2/c2_protocol.h"
+
+namespace Ui {
+class Performance;
+}
+
+class Performance : public QFrame {
+  Q_OBJECT
+
+public:
+  explicit Performance(QWidget *parent = 0);
+  ~Performance();
+  void show(void);
+
+signals:
+  void sendCommand(c2command, uint8_t);
+
+protected:
+  bool eventFilter(QObject *obj, QEvent *event);
+  void closeEvent(QCloseEvent *);
+  void timerEvent(QTimerEvent *);
+
+private:
+  Ui::Performance *ui;
+  int _pollTimerId;
+  // Device restarts its histograms on every readout - totals are kept here.
+  quint64 _latency[LATENCY_STAGES][LATENCY_BUCKETS];
+
+  void _showCounters(const perf_counters_t &counters);
+  void _receiveLatency(const latency_histogram_t &histogram);
+  void _showLatency(void);
+  QString _bucketName(uint8_t bucket);
+
+private slots:
+  void on_clearButton_clicked(void);
+  void on_exportButton_clicked(void);
+};
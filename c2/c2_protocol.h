@@ -51,16 +51,41 @@ enum c2command {
   C2CMD_COMMIT,
   C2CMD_ROLLBACK,
   C2CMD_SET_MODE,
-  C2CMD_GET_MATRIX_STATE
+  C2CMD_GET_MATRIX_STATE,
+  C2CMD_GET_PERF_COUNTERS,
+  C2CMD_GET_LATENCY, // payload[0] is latencyStage
+  C2CMD_UPLOAD_CONFIG_BULK,   // FROM host, see CONFIG_BULK_BLOCK_SIZE
+  C2CMD_DOWNLOAD_CONFIG_BULK, // TO host, payload[0] is first block
 };
 
 enum c2response {
   C2RESPONSE_STATUS = 0x00,
   C2RESPONSE_CONFIG,
   C2RESPONSE_SCANCODE,
-  C2RESPONSE_MATRIX_ROW
+  C2RESPONSE_MATRIX_ROW,
+  C2RESPONSE_BASELINE_ROW,
+  C2RESPONSE_PERF_COUNTERS,
+  C2RESPONSE_MATRIX_TELEMETRY,
+  C2RESPONSE_LATENCY,
+  C2RESPONSE_CONFIG_BULK,
+  C2RESPONSE_CONFIG_ACK,
+  C2RESPONSE_COMMIT,
+  C2RESPONSE_LOG,
 };
 
+/*
+ * C2RESPONSE_MATRIX_TELEMETRY payload: record count, then records.
+ * Record is a row number byte, then readouts of all the row's columns.
+ * With MATRIX_TELEMETRY_ABSOLUTE set in row byte it's 12-bit values, two
+ * per 3 bytes, little-endian (even column takes low 12 bits). Without it -
+ * signed 4-bit deltas to previous value of the key, two per byte, even column
+ * in the low nibble.
+ */
+#define MATRIX_TELEMETRY_ABSOLUTE 0x80
+#define MATRIX_TELEMETRY_ABSOLUTE_BYTES(COLS) (((COLS) * 3 + 1) / 2)
+#define MATRIX_TELEMETRY_DELTA_BYTES(COLS) (((COLS) + 1) / 2)
+#define MATRIX_TELEMETRY_MAX 0x0fff
+
 enum deviceStatus {
   C2DEVSTATUS_SCAN_ENABLED = 0,
   C2DEVSTATUS_OUTPUT_ENABLED,
@@ -72,6 +97,10 @@ enum deviceStatus {
 enum capsenseFlags {
   CSF_OE = 0,
   CSF_NL = 1,
+  CSF_ADAPTIVE = 2, // Thresholds follow per-key baseline
+  CSF_EAGER = 3, // Report press on first sample, debounce release only
+  CSF_COALESCE = 5, // All events due in a tick go out in one report
+  CSF_SOF_ALIGN = 6, // Last matrix pass of a USB frame ends before host poll
 };
 
 enum deviceMode {
@@ -102,6 +131,93 @@ typedef union {
   uint8_t raw[4];
 } device_status_t;
 
+/*
+ * Scan engine counters. Min/max/high-water marks restart on every readout,
+ * rate and average are for the last full second.
+ */
+typedef union {
+  struct {
+    uint32_t passesPerSecond;
+    uint32_t isrMinCycles; // Result_ISR duration, CPU cycles
+    uint32_t isrAvgCycles;
+    uint32_t isrMaxCycles;
+    uint32_t scancodeOverwrites; // since apply_config
+    uint8_t scancodeHighWater;
+    uint8_t usbQueueNow;
+    uint8_t usbQueueHighWater;
+    uint32_t keymapMaxCycles; // longest keymap rebuild slice
+    uint32_t usbQueueOverflows; // events dropped, since apply_config
+    uint32_t macroOverflows; // macros not played - all contexts busy
+    uint32_t c2Overflows; // C2 messages dropped, send queue full
+    // From end of last pass in a USB frame to its poll, us. See scan.h.
+    uint32_t sofPhaseAvg;
+    uint32_t sofPhaseMax;
+  } __attribute__((packed));
+  uint8_t raw[47];
+} perf_counters_t;
+
+/*
+ * Keystroke latency, microseconds. Stages follow an event from detection in
+ * the scanner to USB_LoadInEP. Send and total count reports, not events -
+ * report is timed by the first event played into it.
+ */
+enum latencyStage {
+  LATENCY_PICKUP = 0, // scanner -> process_scancode_buffer
+  LATENCY_QUEUE,      // -> queue_usbcode, includes macro waits
+  LATENCY_REPORT,     // -> update_reports
+  LATENCY_SEND,       // -> USB_LoadInEP
+  LATENCY_TOTAL,      // scanner -> USB_LoadInEP
+  LATENCY_STAGES
+};
+
+static const char *const latencyStageNames[] = {
+    "Detect to pickup", "Pickup to queue", "Queue to report",
+    "Report to endpoint", "Total",
+};
+
+/*
+ * Bucket 0 is 0us, bucket N is [2^(N-1), 2^N) us, last one is open-ended.
+ * Counts saturate, restart on every readout.
+ */
+#define LATENCY_BUCKETS 16
+
+typedef union {
+  struct {
+    uint8_t stage;
+    uint16_t counts[LATENCY_BUCKETS];
+  } __attribute__((packed));
+  uint8_t raw[1 + LATENCY_BUCKETS * 2];
+} latency_histogram_t;
+
+/*
+ * Device log. Firmware stores message ID and raw 32-bit arguments, host
+ * formats them with logFormats - both come from LOG_MESSAGES, so they can't
+ * get out of sync. Append only, IDs are positional.
+ * C2RESPONSE_LOG payload: messages lost since last packet, record count,
+ * then records - ID, argument count, arguments little-endian.
+ */
+#define LOG_MESSAGES(X)                                                        \
+  X(LOG_CONFIG_UPLOAD_STATUS, "Invalid status register for config upload")     \
+  X(LOG_OLD_EEPROM, "Old version of EEPROM - possibly unpredictable results.") \
+  X(LOG_EEPROM_UPDATE, "Updating EEPROM GO!")                                  \
+  X(LOG_BOOTLOADER, "Jumping to bootloader..")                                 \
+  X(LOG_APPLY_CONFIG, "Applying config..")                                     \
+  X(LOG_RESETTING, "Resetting..")                                              \
+  X(LOG_CONSUMER_EXISTING, "Existing %d pos %d")                               \
+  X(LOG_SCANNER_INSANE, "Scan module has gone insane and had to be shot!")     \
+  X(LOG_ADB_ERROR, "ADB Error: received %x")                                   \
+  X(LOG_ADB_CODES, "%02x %02x")                                                \
+  X(LOG_SCANCODE_LEVELS, "sc: %d %d @ %d ms, lvl %d/%d")                     \
+  X(LOG_CONFIG_BLOCK_RANGE, "Config block %d is past the end")
+
+#define LOG_MESSAGE_ID(ID, FORMAT) ID,
+#define LOG_MESSAGE_FORMAT(ID, FORMAT) FORMAT,
+enum logMessage { LOG_MESSAGES(LOG_MESSAGE_ID) LOG_MESSAGE_COUNT };
+static const char *const logFormats[] = {LOG_MESSAGES(LOG_MESSAGE_FORMAT)};
+
+#define LOG_MAX_ARGS 5
+#define LOG_RECORD_HEADER 2
+
 typedef union {
   struct {
     unsigned char response_type;
@@ -143,6 +259,54 @@ typedef union {
 #define CONFIG_TRANSFER_BLOCK_SIZE 32
 #define CONFIG_BLOCK_DATA_OFFSET 1
 
+/*
+ * Windowed config transfer. Packet is command/response byte, block number,
+ * then CONFIG_BULK_BLOCK_SIZE bytes of config - last block is partial.
+ * Receiver takes blocks in order only and acks cumulatively with
+ * config_bulk_ack_t: next block it expects, CRC of everything before it.
+ * Upload: device has a single SET_REPORT buffer, so it acks every block and
+ * host sends the next one only on a response (CTS) - up to
+ * CONFIG_BULK_WINDOW blocks are queued ahead of acks. First block out of
+ * order is acked with rewind set, host resends from next. Block 0 restarts.
+ * Download: device streams from the block asked to the end, then acks.
+ */
+#define CONFIG_BULK_BLOCK_SIZE 62
+#define CONFIG_BULK_BLOCKS(BYTES)                                              \
+  (((BYTES) + CONFIG_BULK_BLOCK_SIZE - 1) / CONFIG_BULK_BLOCK_SIZE)
+#define CONFIG_BULK_WINDOW 8
+#define CONFIG_CRC_INIT 0xffff
+
+typedef union {
+  struct {
+    uint8_t next;
+    uint16_t crc;
+    uint8_t rewind;
+  } __attribute__((packed));
+  uint8_t raw[4];
+} config_bulk_ack_t;
+
+// C2RESPONSE_COMMIT payload. EEPROM is written a row at a time.
+typedef union {
+  struct {
+    uint8_t rowsWritten;
+    uint8_t rowsFailed; // stay dirty, next commit retries them
+    uint32_t micros;
+  } __attribute__((packed));
+  uint8_t raw[6];
+} commit_result_t;
+
+// CRC-16/CCITT, bitwise - a block at a time is cheap enough.
+static inline uint16_t config_crc(uint16_t crc, const uint8_t *data,
+                                  uint16_t len) {
+  while (len--) {
+    crc ^= (uint16_t)(*data++) << 8;
+    for (uint8_t i = 0; i < 8; i++) {
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+  }
+  return crc;
+}
+
 #define MACRO_TYPE_ONKEYUP 0x80
 #define MACRO_TYPE_TAP 0x40
 
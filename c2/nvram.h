@@ -28,6 +28,10 @@
 #endif
 
 #define MAX_DEBOUNCING_BUFFER_SIZE 16
+#define MAX_FILTER_DEPTH 5
+// Eager press lockout, scan passes. Old configs have 0xff there.
+#define DEFAULT_EAGER_LOCKOUT 16
+#define MAX_EAGER_LOCKOUT 64
 
 typedef union {
   struct {
@@ -42,11 +46,14 @@ typedef union {
     uint8_t adcBits;
     uint8_t chargeDelay;
     uint16_t dischargeDelay;
-    uint8_t debouncingTicks;
-    uint8_t _RESERVED0[3];
+    uint8_t debouncingTicks; // key changes after N-1 same samples, 1 == 2
+    uint8_t pressOffset; // Adaptive thresholds, relative to key baseline
+    uint8_t releaseOffset;
+    uint8_t filterDepth; // IIR over 2^filterDepth passes, 0 = off
     uint16_t delayLib[NUM_DELAYS]; // 2 bytes per item!
     uint8_t layerConditions[NUM_LAYER_CONDITIONS];
-    uint8_t _RESERVED1[8];
+    uint8_t eagerLockout; // passes a key can't release after eager press
+    uint8_t _RESERVED1[7];
 // CONFIG SIZE - count up from here.
 // Storage is for layout-size-specifics and MUST NOT be sized here
 // because firmware can know sizes in advance, while FlightController can't.
@@ -7,13 +7,12 @@
  * published by the Free Software Foundation.
  */
 #include <project.h>
-#include <stdio.h>
 #include "exp.h"
 #include "globals.h"
 
 #include "PSoC_USB.h"
 
-// for xprintf - stdio + stdarg
+// for log_event
 #include <stdarg.h>
 
 #define USB_STATUS_CONNECTED 0
@@ -21,20 +20,38 @@
 uint8_t usb_status = USB_STATUS_DISCONNECTED;
 uint8_t wakeup_enabled = 0;
 
+/*
+ * HID reports are state - only the newest matters, as long as the host sees
+ * every change. One slot per endpoint holds the newest state not loaded yet,
+ * updates merge into it. A key whose change is still in the slot is marked
+ * unsent - pipeline holds its next event until the endpoint takes the slot,
+ * so a press and a release never meet in one report. Reports are built in
+ * the endpoint's IN buffer and copied here.
+ */
 typedef struct {
   uint8_t EP;
+  uint8_t *outbox;
+  bool pending;
   uint8_t len;
-  uint8_t data[64];
-} UsbPdu_t;
-
-#define USB_BUFFER_END 3
-#define USB_BUFFER_NEXT(X) ((X + 1) & USB_BUFFER_END)
-#define USB_BUFFER_PREV(X) ((X + USB_BUFFER_END) & USB_BUFFER_END)
-// ^^^ THIS MUST EQUAL 2^n-1!!! Used as bitmask.
+  uint8_t data[sizeof keyboard_report.raw]; // biggest report there is
+  latency_tag_t latency; // oldest update in data
+  uint8_t sent_len;
+  uint8_t sent[sizeof keyboard_report.raw]; // what the endpoint got last
+  uint32_t unsent[256 / 32]; // keycodes whose change is only in data
+} UsbReportSlot_t;
+
+UsbReportSlot_t usbReports[USB_REPORTS] = {
+    [KBD_REPORT] = {KBD_EP, KBD_OUTBOX},
+    [CONSUMER_REPORT] = {CONSUMER_EP, CONSUMER_OUTBOX},
+    [SYSTEM_REPORT] = {SYSTEM_EP, SYSTEM_OUTBOX},
+};
 
-UsbPdu_t usbSendingQueue[4];
-uint8_t usbSendingReadPos = 0;
-uint8_t usbSendingWritePos = 0;
+// C2 messages are not - they queue. Newest is dropped when full.
+#define C2_QUEUE_SIZE 4
+// ^^^ THIS MUST EQUAL 2^n! Used as bitmask.
+uint8_t c2Queue[C2_QUEUE_SIZE][sizeof outbox.raw];
+uint8_t c2QueueHead = 0;
+uint8_t c2QueueCount = 0;
 
 // How long (in system ticks) to wait for power to be disconnected
 // Used to tell apart cable disconnect from USB suspend.
@@ -52,12 +69,41 @@ void report_status(void) {
   EEPROM_UpdateTemperature();
   outbox.payload[3] = dieTemperature[0];
   outbox.payload[4] = dieTemperature[1];
+  memcpy(&outbox.payload[5], &eager_glitches, sizeof(eager_glitches));
   usb_send_c2();
   // xprintf("time: %d", systime);
   // xprintf("LED status: %d %d %d %d %d", led_status&0x01, led_status&0x02,
   // led_status&0x04, led_status&0x08, led_status&0x10);
 }
 
+void report_perf_counters(void) {
+  outbox.response_type = C2RESPONSE_PERF_COUNTERS;
+  perf.usbQueueNow = USBQueue_count;
+  uint8_t enableInterrupts = CyEnterCriticalSection();
+  memcpy(outbox.payload, perf.raw, sizeof perf.raw);
+  perf.isrMinCycles = UINT32_MAX;
+  perf.isrMaxCycles = 0;
+  perf.scancodeHighWater = 0;
+  perf.usbQueueHighWater = 0;
+  perf.keymapMaxCycles = 0;
+  perf.sofPhaseMax = 0;
+  CyExitCriticalSection(enableInterrupts);
+  usb_send_c2();
+}
+
+void report_latency(uint8_t stage) {
+  if (stage >= LATENCY_STAGES) {
+    return;
+  }
+  latency_histogram_t histogram;
+  histogram.stage = stage;
+  memcpy(histogram.counts, latency[stage], sizeof histogram.counts);
+  memset(latency[stage], 0, sizeof latency[stage]);
+  outbox.response_type = C2RESPONSE_LATENCY;
+  memcpy(outbox.payload, histogram.raw, sizeof histogram.raw);
+  usb_send_c2();
+}
+
 void process_ewo(OUT_c2packet_t *inbox) {
   status_register = inbox->payload[0];
   //xprintf("EWO signal received: %d", inbox->payload[0]);
@@ -66,14 +112,34 @@ void process_ewo(OUT_c2packet_t *inbox) {
   }
 }
 
+/*
+ * EEPROM rows config differs from, bit per row. Every EEPROM write programs
+ * a whole row, so commit writes each dirty row once.
+ */
+#define EEPROM_ROWS (EEPROM_BYTESIZE / CY_EEPROM_SIZEOF_ROW)
+uint8_t eeprom_dirty[EEPROM_ROWS / 8];
+
+static void mark_config_dirty(uint16_t offset, uint16_t len) {
+  uint8_t last = (offset + len - 1) / CY_EEPROM_SIZEOF_ROW;
+  for (uint8_t row = offset / CY_EEPROM_SIZEOF_ROW; row <= last; row++) {
+    SET_BIT(eeprom_dirty[row / 8], row % 8);
+  }
+}
+
 void receive_config_block(OUT_c2packet_t *inbox) {
   if (status_register != (1 << C2DEVSTATUS_SETUP_MODE)) {
-    xprintf("Invalid status register for config upload");
+    LOG(LOG_CONFIG_UPLOAD_STATUS);
+    return;
+  }
+  if (inbox->payload[0] >= EEPROM_BYTESIZE / CONFIG_TRANSFER_BLOCK_SIZE) {
+    LOG(LOG_CONFIG_BLOCK_RANGE, inbox->payload[0]);
     return;
   }
   // TODO define offset via transfer block size and packet size
   memcpy(config.raw + (inbox->payload[0] * CONFIG_TRANSFER_BLOCK_SIZE),
          inbox->payload + CONFIG_BLOCK_DATA_OFFSET, CONFIG_TRANSFER_BLOCK_SIZE);
+  mark_config_dirty(inbox->payload[0] * CONFIG_TRANSFER_BLOCK_SIZE,
+                    CONFIG_TRANSFER_BLOCK_SIZE);
   memset(outbox.raw, 0, sizeof(outbox));
   outbox.response_type = C2RESPONSE_CONFIG;
   outbox.payload[0] = inbox->payload[0];
@@ -81,6 +147,10 @@ void receive_config_block(OUT_c2packet_t *inbox) {
 }
 
 void send_config_block(OUT_c2packet_t *inbox) {
+  if (inbox->payload[0] >= EEPROM_BYTESIZE / CONFIG_TRANSFER_BLOCK_SIZE) {
+    LOG(LOG_CONFIG_BLOCK_RANGE, inbox->payload[0]);
+    return;
+  }
   memset(outbox.raw, 0, sizeof(outbox));
   outbox.response_type = C2RESPONSE_CONFIG;
   outbox.payload[0] = inbox->payload[0];
@@ -90,6 +160,95 @@ void send_config_block(OUT_c2packet_t *inbox) {
   usb_send_c2();
 }
 
+#define CONFIG_BULK_TOTAL CONFIG_BULK_BLOCKS(EEPROM_BYTESIZE)
+#define CONFIG_BULK_IDLE (CONFIG_BULK_TOTAL + 1)
+#if CONFIG_BULK_IDLE > 0xff
+#error Config blocks must be numbered by a byte
+#endif
+
+// Windowed transfer state - see CONFIG_BULK_BLOCK_SIZE.
+uint8_t bulk_expected;
+uint16_t bulk_crc;
+bool bulk_rewound;
+uint8_t bulk_next = CONFIG_BULK_IDLE;
+uint16_t bulk_next_crc;
+
+static inline uint8_t bulk_block_len(uint8_t block) {
+  uint16_t offset = block * CONFIG_BULK_BLOCK_SIZE;
+  return (EEPROM_BYTESIZE - offset < CONFIG_BULK_BLOCK_SIZE)
+             ? EEPROM_BYTESIZE - offset
+             : CONFIG_BULK_BLOCK_SIZE;
+}
+
+static void send_bulk_ack(uint8_t next, uint16_t crc, bool rewind) {
+  config_bulk_ack_t ack;
+  ack.next = next;
+  ack.crc = crc;
+  ack.rewind = rewind;
+  memset(outbox.raw, 0, sizeof(outbox));
+  outbox.response_type = C2RESPONSE_CONFIG_ACK;
+  memcpy(outbox.payload, ack.raw, sizeof ack.raw);
+  usb_send_c2();
+}
+
+void receive_config_bulk(OUT_c2packet_t *inbox) {
+  if (status_register != (1 << C2DEVSTATUS_SETUP_MODE)) {
+    LOG(LOG_CONFIG_UPLOAD_STATUS);
+    return;
+  }
+  uint8_t block = inbox->payload[0];
+  if (block == 0) {
+    bulk_expected = 0;
+    bulk_crc = CONFIG_CRC_INIT;
+  }
+  if (block != bulk_expected || block >= CONFIG_BULK_TOTAL) {
+    // Lost or repeated block - everything after it is dropped too. Host
+    // rewinds on the first one, the rest are acked only to keep CTS going.
+    send_bulk_ack(bulk_expected, bulk_crc, !bulk_rewound);
+    bulk_rewound = true;
+    return;
+  }
+  uint8_t len = bulk_block_len(block);
+  uint8_t *dest = config.raw + block * CONFIG_BULK_BLOCK_SIZE;
+  memcpy(dest, inbox->payload + 1, len);
+  mark_config_dirty(block * CONFIG_BULK_BLOCK_SIZE, len);
+  bulk_crc = config_crc(bulk_crc, dest, len);
+  bulk_expected++;
+  bulk_rewound = false;
+  send_bulk_ack(bulk_expected, bulk_crc, false);
+}
+
+void send_config_bulk(OUT_c2packet_t *inbox) {
+  bulk_next = inbox->payload[0] < CONFIG_BULK_TOTAL ? inbox->payload[0]
+                                                    : CONFIG_BULK_TOTAL;
+  // Host asks from the middle only to recover - rare enough to pay here.
+  bulk_next_crc = config_crc(CONFIG_CRC_INIT, config.raw,
+                             bulk_next * CONFIG_BULK_BLOCK_SIZE);
+}
+
+/*
+ * Streams download blocks as C2 queue frees up. Last slot is left for
+ * whatever else wants to talk to the host meanwhile.
+ */
+static void config_bulk_tick(void) {
+  while (bulk_next != CONFIG_BULK_IDLE && c2QueueCount < C2_QUEUE_SIZE - 1) {
+    if (bulk_next == CONFIG_BULK_TOTAL) {
+      send_bulk_ack(CONFIG_BULK_TOTAL, bulk_next_crc, false);
+      bulk_next = CONFIG_BULK_IDLE;
+      return;
+    }
+    uint8_t len = bulk_block_len(bulk_next);
+    uint8_t *src = config.raw + bulk_next * CONFIG_BULK_BLOCK_SIZE;
+    memset(outbox.raw, 0, sizeof(outbox));
+    outbox.response_type = C2RESPONSE_CONFIG_BULK;
+    outbox.payload[0] = bulk_next;
+    memcpy(outbox.payload + 1, src, len);
+    usb_send_c2();
+    bulk_next_crc = config_crc(bulk_next_crc, src, len);
+    bulk_next++;
+  }
+}
+
 void set_hardware_parameters(void) {
   FORCE_BIT(config.capsenseFlags, CSF_NL, NORMALLY_LOW);
   config.matrixRows = MATRIX_ROWS;
@@ -109,6 +268,22 @@ void set_hardware_parameters(void) {
   if (config.dischargeDelay < 2) {
     config.dischargeDelay = 2;
   }
+  if (config.pressOffset == 0 || config.pressOffset == EMPTY_FLASH_BYTE) {
+    // Never configured - adaptive mode would fire on noise.
+    CLEAR_BIT(config.capsenseFlags, CSF_ADAPTIVE);
+  }
+  if (config.releaseOffset > config.pressOffset) {
+    // No hysteresis is the best we can do.
+    config.releaseOffset = config.pressOffset;
+  }
+  if (config.filterDepth > MAX_FILTER_DEPTH) {
+    config.filterDepth = 0;
+  }
+  if (config.eagerLockout == EMPTY_FLASH_BYTE) {
+    config.eagerLockout = DEFAULT_EAGER_LOCKOUT;
+  } else if (config.eagerLockout > MAX_EAGER_LOCKOUT) {
+    config.eagerLockout = MAX_EAGER_LOCKOUT;
+  }
   if (config.debouncingTicks < 1) {
     config.debouncingTicks = 1;
   } else if (config.debouncingTicks > MAX_DEBOUNCING_BUFFER_SIZE) {
@@ -130,8 +305,9 @@ void load_config(void) {
   CyEEPROM_ReadRelease();
   CyExitCriticalSection(interruptState);
   EEPROM_Stop();
+  memset(eeprom_dirty, 0, sizeof eeprom_dirty);
   if (config.configVersion != CS_CONFIG_VERSION) {
-    xprintf("Old version of EEPROM - possibly unpredictable results.");
+    LOG(LOG_OLD_EEPROM);
   }
   set_hardware_parameters();
 }
@@ -145,18 +321,42 @@ void apply_config(void) {
 
 void save_config(void) {
   set_hardware_parameters();
+  // Whatever it had to fix is in the header.
+  mark_config_dirty(0, COMMONSENSE_BASE_SIZE);
   EEPROM_Start();
   CyDelayUs(5);
   EEPROM_UpdateTemperature();
-  xprintf("Updating EEPROM GO!");
-  uint16 bytes_modified = 0;
-  for (uint16 i = 0; i < EEPROM_BYTESIZE; i++)
-    if (config.raw[i] != EEPROM_ReadByte(i)) {
-      EEPROM_WriteByte(config.raw[i], i);
-      bytes_modified++;
+  LOG(LOG_EEPROM_UPDATE);
+  commit_result_t result;
+  result.rowsWritten = 0;
+  result.rowsFailed = 0;
+  uint64_t started = timestamp_us();
+  for (uint8_t row = 0; row < EEPROM_ROWS; row++) {
+    if (!TEST_BIT(eeprom_dirty[row / 8], row % 8)) {
+      continue;
+    }
+    uint16_t offset = row * CY_EEPROM_SIZEOF_ROW;
+    uint8_t i = 0;
+    // Reading is cheap - don't program a row that came back unchanged.
+    while (i < CY_EEPROM_SIZEOF_ROW &&
+           config.raw[offset + i] == EEPROM_ReadByte(offset + i)) {
+      i++;
     }
+    if (i < CY_EEPROM_SIZEOF_ROW) {
+      if (EEPROM_Write(config.raw + offset, row) != CYRET_SUCCESS) {
+        result.rowsFailed++;
+        continue;
+      }
+      result.rowsWritten++;
+    }
+    CLEAR_BIT(eeprom_dirty[row / 8], row % 8);
+  }
+  result.micros = timestamp_us() - started;
   EEPROM_Stop();
-  xprintf("Written %d bytes!", bytes_modified);
+  memset(outbox.raw, 0, sizeof(outbox));
+  outbox.response_type = C2RESPONSE_COMMIT;
+  memcpy(outbox.payload, result.raw, sizeof result.raw);
+  usb_send_c2();
 }
 
 void usb_receive(OUT_c2packet_t *inbox) {
@@ -173,7 +373,7 @@ void usb_receive(OUT_c2packet_t *inbox) {
     report_status();
     break;
   case C2CMD_ENTER_BOOTLOADER:
-    xprintf("Jumping to bootloader..");
+    LOG(LOG_BOOTLOADER);
     Boot_Load(); // Does not return, no need for break
   case C2CMD_UPLOAD_CONFIG:
     receive_config_block(inbox);
@@ -181,8 +381,14 @@ void usb_receive(OUT_c2packet_t *inbox) {
   case C2CMD_DOWNLOAD_CONFIG:
     send_config_block(inbox);
     break;
+  case C2CMD_UPLOAD_CONFIG_BULK:
+    receive_config_bulk(inbox);
+    break;
+  case C2CMD_DOWNLOAD_CONFIG_BULK:
+    send_config_bulk(inbox);
+    break;
   case C2CMD_APPLY_CONFIG:
-    xprintf("Applying config..");
+    LOG(LOG_APPLY_CONFIG);
     SET_BIT(status_register, C2DEVSTATUS_SETUP_MODE);
     apply_config();
     report_status();
@@ -191,91 +397,231 @@ void usb_receive(OUT_c2packet_t *inbox) {
     save_config();
     break;
   case C2CMD_ROLLBACK:
-    xprintf("Resetting..");
+    LOG(LOG_RESETTING);
     CySoftwareReset(); // Does not return, no need for break.
   case C2CMD_GET_MATRIX_STATE:
     FORCE_BIT(status_register, C2DEVSTATUS_MATRIX_MONITOR, inbox->payload[0]);
     scan_reset();
     break;
+  case C2CMD_GET_PERF_COUNTERS:
+    report_perf_counters();
+    break;
+  case C2CMD_GET_LATENCY:
+    report_latency(inbox->payload[0]);
+    break;
   default:
     break;
   }
 }
 
-void usbEnqueue(uint8_t EP, uint8_t len, uint8_t *data) {
-  usbSendingWritePos = USB_BUFFER_NEXT(usbSendingWritePos);
-  usbSendingQueue[usbSendingWritePos].EP = EP;
-  usbSendingQueue[usbSendingWritePos].len = len;
-  memcpy(usbSendingQueue[usbSendingWritePos].data, data, len);
+void usb_send_report(uint8_t report, uint8_t len) {
+  UsbReportSlot_t *slot = &usbReports[report];
+  memcpy(slot->data, slot->outbox, len);
+  slot->len = len;
+  if (len == slot->sent_len && memcmp(slot->data, slot->sent, len) == 0) {
+    // Back to what host has - nothing to send.
+    slot->pending = false;
+    memset(slot->unsent, 0, sizeof slot->unsent);
+  } else if (!slot->pending) {
+    slot->pending = true;
+    slot->latency = report_tag;
+  }
+  // Otherwise merged into pending state - timed from the older update.
+  report_tag.valid = false;
+}
+
+bool usb_usage_unsent(uint8_t keycode) {
+  for (uint8_t i = 0; i < USB_REPORTS; i++) {
+    if (TEST_BIT(usbReports[i].unsent[keycode / 32], keycode % 32)) {
+      return true;
+    }
+  }
+  return false;
 }
 
 void usbSend() {
   if (usb_status != USB_STATUS_CONNECTED) {
     return;
   }
-  while (usbSendingWritePos != usbSendingReadPos) {
-    uint8_t pos = USB_BUFFER_NEXT(usbSendingReadPos);
-    if (USB_GetEPState(usbSendingQueue[pos].EP) == USB_IN_BUFFER_EMPTY) {
-      USB_LoadInEP(usbSendingQueue[pos].EP,
-          usbSendingQueue[pos].data, usbSendingQueue[pos].len);
-      usbSendingReadPos = pos;
-    } else {
-      break;
+  for (uint8_t i = 0; i < USB_REPORTS; i++) {
+    UsbReportSlot_t *slot = &usbReports[i];
+    if (!slot->pending || USB_GetEPState(slot->EP) != USB_IN_BUFFER_EMPTY) {
+      continue;
+    }
+    USB_LoadInEP(slot->EP, slot->data, slot->len);
+    memcpy(slot->sent, slot->data, slot->len);
+    slot->sent_len = slot->len;
+    slot->pending = false;
+    memset(slot->unsent, 0, sizeof slot->unsent);
+    if (slot->latency.valid) {
+      uint64_t now = timestamp_us();
+      latency_record(LATENCY_SEND, now - slot->latency.played);
+      latency_record(LATENCY_TOTAL, now - slot->latency.detected);
     }
   }
+  if (c2QueueCount > 0 && USB_GetEPState(OUTBOX_EP) == USB_IN_BUFFER_EMPTY) {
+    USB_LoadInEP(OUTBOX_EP, c2Queue[c2QueueHead], sizeof outbox.raw);
+    c2QueueHead = (c2QueueHead + 1) & (C2_QUEUE_SIZE - 1);
+    c2QueueCount--;
+  }
 }
 
 void usb_send_c2(void) {
-  usbEnqueue(OUTBOX_EP, sizeof(outbox.raw), outbox.raw);
+  if (c2QueueCount == C2_QUEUE_SIZE) {
+    perf.c2Overflows++;
+    return;
+  }
+  memcpy(c2Queue[(c2QueueHead + c2QueueCount) & (C2_QUEUE_SIZE - 1)],
+         outbox.raw, sizeof outbox.raw);
+  c2QueueCount++;
+}
+
+/*
+ * Nothing waiting to go out and C2 endpoint is free - for senders that would
+ * rather drop a packet than wait.
+ */
+bool usb_c2_idle(void) {
+  return usb_status == USB_STATUS_CONNECTED && c2QueueCount == 0 &&
+         USB_GetEPState(OUTBOX_EP) == USB_IN_BUFFER_EMPTY;
 }
 
 void usb_send_c2_blocking(void) {
   usb_send_c2();
-  while (usbSendingReadPos != usbSendingWritePos) {
+  while (c2QueueCount > 0) {
     usbSend();
   }
 }
 
-// Very similar to consumer_press, but keycode there is uint16_t :(
-inline void keyboard_press(uint8_t keycode) {
-  if ((keycode & 0xf8) == 0xe0) {
-    keyboard_report.mods |= (1 << (keycode & 0x07));
+/*
+ * Log ring. Records go out packed into C2RESPONSE_LOG when C2 is idle, so
+ * logging never delays a response. Newest is dropped when full.
+ */
+#define LOG_RING_SIZE 8
+// ^^^ THIS MUST EQUAL 2^n! Used as bitmask.
+typedef struct {
+  uint8_t id;
+  uint8_t argc;
+  uint32_t args[LOG_MAX_ARGS];
+} log_record_t;
+log_record_t log_ring[LOG_RING_SIZE];
+uint8_t log_head = 0;
+uint8_t log_count = 0;
+uint8_t log_lost = 0;
+
+void log_event(uint8_t argc, uint8_t id, ...) {
+  uint8_t enableInterrupts = CyEnterCriticalSection();
+  if (log_count == LOG_RING_SIZE) {
+    if (log_lost < UINT8_MAX) {
+      log_lost++;
+    }
+  } else {
+    log_record_t *record =
+        &log_ring[(log_head + log_count) & (LOG_RING_SIZE - 1)];
+    record->id = id;
+    record->argc = argc;
+    va_list va;
+    va_start(va, id);
+    for (uint8_t i = 0; i < argc; i++) {
+      record->args[i] = va_arg(va, uint32_t);
+    }
+    va_end(va);
+    log_count++;
+  }
+  CyExitCriticalSection(enableInterrupts);
+}
+
+static void log_drain(void) {
+  if (log_count == 0 || !usb_c2_idle()) {
     return;
   }
-  for (uint8_t cur_pos = 0; cur_pos < sizeof keyboard_report.keys; cur_pos++) {
-    if (keyboard_report.keys[cur_pos] == keycode) {
-      xprintf("Existing %d pos %d", keycode, cur_pos);
-      return;
-    } else if (keyboard_report.keys[cur_pos] == 0) {
-      keyboard_report.keys[cur_pos] = keycode;
-      keyboard_report_usage = cur_pos + 1;
-      // xprintf("Pressed %d pos %d, usage %d", keycode, cur_pos,
-      // keyboard_report_usage);
-      return;
+  memset(outbox.raw, 0, sizeof(outbox));
+  outbox.response_type = C2RESPONSE_LOG;
+  uint8_t pos = 2;
+  uint8_t enableInterrupts = CyEnterCriticalSection();
+  outbox.payload[0] = log_lost;
+  log_lost = 0;
+  while (log_count > 0) {
+    log_record_t *record = &log_ring[log_head];
+    uint8_t len = LOG_RECORD_HEADER + record->argc * sizeof(uint32_t);
+    if (pos + len > sizeof(outbox.payload)) {
+      break;
     }
+    outbox.payload[pos] = record->id;
+    outbox.payload[pos + 1] = record->argc;
+    memcpy(&outbox.payload[pos + LOG_RECORD_HEADER], record->args,
+           record->argc * sizeof(uint32_t));
+    pos += len;
+    outbox.payload[1]++;
+    log_head = (log_head + 1) & (LOG_RING_SIZE - 1);
+    log_count--;
+  }
+  CyExitCriticalSection(enableInterrupts);
+  usb_send_c2();
+}
+
+inline void keyboard_press(uint8_t keycode) {
+  if ((keycode & 0xf8) == 0xe0) {
+    keyboard_report.mods |= (1 << (keycode & 0x07));
+  } else if (keycode < KBD_USAGES) {
+    keyboard_report.keys[keycode / 8] |= (1 << (keycode % 8));
   }
 }
 
-// Very similar to consumer_release, but keycode there is uint16_t :(
 inline void keyboard_release(uint8_t keycode) {
   if ((keycode & 0xf8) == 0xe0) {
     keyboard_report.mods &= ~(1 << (keycode & 0x07));
-    return;
-  }
-  bool move = false;
-  for (uint8_t cur_pos = 0; cur_pos < sizeof keyboard_report.keys; cur_pos++) {
-    if (move) {
-      keyboard_report.keys[cur_pos - 1] = keyboard_report.keys[cur_pos];
-    } else if (keyboard_report.keys[cur_pos] == keycode) {
-      move = true;
+  } else if (keycode < KBD_USAGES) {
+    keyboard_report.keys[keycode / 8] &= ~(1 << (keycode % 8));
+  }
+}
+
+// Fills KBD_OUTBOX with boot protocol report, returns its length.
+static uint8_t keyboard_boot_report(void) {
+  memset(KBD_OUTBOX, 0, KBD_BOOT_REPORT_SIZE);
+  KBD_OUTBOX[0] = keyboard_report.mods;
+  uint8_t used = 0;
+  for (uint8_t i = 0; i < sizeof keyboard_report.keys; i++) {
+    uint8_t bits = keyboard_report.keys[i];
+    while (bits) {
+      if (used == KBD_BOOT_KEYS) {
+        // on rollover error ALL keys must report ERO.
+        memset(KBD_OUTBOX + 2, USBCODE_ERO, KBD_BOOT_KEYS);
+        return KBD_BOOT_REPORT_SIZE;
+      }
+      KBD_OUTBOX[2 + used++] = i * 8 + __builtin_ctz(bits);
+      bits &= bits - 1;
     }
   }
-  if (move) {
-    // Key was, in fact, pressed.
-    keyboard_report.keys[sizeof keyboard_report.keys - 1] = 0;
-    keyboard_report_usage--;
-    // xprintf("Released %d, usage %d", keycode, keyboard_report_usage);
+  return KBD_BOOT_REPORT_SIZE;
+}
+
+/*
+ * While held, report updates only mark their report pending - pipeline
+ * is applying a whole tick of events, each report goes out once at release.
+ */
+bool reports_held;
+uint8_t reports_pending;
+enum { PENDING_KBD, PENDING_CONSUMER, PENDING_SYSTEM };
+
+// Change of keycode's state is in the report now, host doesn't have it yet.
+static inline void mark_unsent(uint8_t report, uint8_t keycode) {
+  SET_BIT(usbReports[report].unsent[keycode / 32], keycode % 32);
+}
+
+// Protocol the last keyboard report was built for.
+uint8_t kbd_protocol = USB_PROTOCOL_REPORT;
+
+static void send_keyboard_report(void) {
+  uint8_t len;
+  kbd_protocol = USB_GetProtocol(KBD_INTERFACE);
+  if (kbd_protocol == USB_PROTOCOL_BOOT) {
+    len = keyboard_boot_report();
+  } else {
+    memcpy(KBD_OUTBOX, keyboard_report.raw, sizeof keyboard_report.raw);
+    len = sizeof keyboard_report.raw;
   }
+  _WIPE_OUTBOX(KBD_OUTBOX);
+  usb_send_report(KBD_REPORT, len);
 }
 
 void update_keyboard_report(queuedScancode *key) {
@@ -285,13 +631,12 @@ void update_keyboard_report(queuedScancode *key) {
   } else {
     keyboard_release(key->keycode);
   }
-  memcpy(KBD_OUTBOX, keyboard_report.raw, OUTBOX_SIZE(KBD_OUTBOX));
-  if (keyboard_report_usage > KBD_KRO_LIMIT) {
-    // on rollover error ALL keys must report ERO.
-    memset(KBD_OUTBOX + 2, USBCODE_ERO, KBD_KRO_LIMIT);
-    xprintf("Keyboard rollover error");
+  mark_unsent(KBD_REPORT, key->keycode);
+  if (reports_held) {
+    SET_BIT(reports_pending, PENDING_KBD);
+  } else {
+    send_keyboard_report();
   }
-  USB_SEND_REPORT(KBD);
 }
 
 const uint16_t consumer_mapping[16] = {
@@ -313,11 +658,10 @@ const uint16_t consumer_mapping[16] = {
     // 16
 };
 
-// Very similar to keyboard_press, but keycode there is uint8_t :(
 static inline void consumer_press(uint16_t keycode) {
   for (uint8_t cur_pos = 0; cur_pos < CONSUMER_KRO_LIMIT; cur_pos++) {
     if (consumer_report[cur_pos] == keycode) {
-      xprintf("Existing %d pos %d", keycode, cur_pos);
+      LOG(LOG_CONSUMER_EXISTING, keycode, cur_pos);
       break;
     } else if (consumer_report[cur_pos] == 0) {
       consumer_report[cur_pos] = keycode;
@@ -328,7 +672,6 @@ static inline void consumer_press(uint16_t keycode) {
   // xprintf("C_Pressing %d", keycode);
 }
 
-// Very similar to keyboard_release, but keycode there is uint8_t :(
 static inline void consumer_release(uint16_t keycode) {
   uint8_t cur_pos;
   bool move = false;
@@ -346,6 +689,11 @@ static inline void consumer_release(uint16_t keycode) {
   }
 }
 
+static void send_consumer_report(void) {
+  memcpy(CONSUMER_OUTBOX, consumer_report, OUTBOX_SIZE(CONSUMER_OUTBOX));
+  USB_SEND_REPORT(CONSUMER);
+}
+
 void update_consumer_report(queuedScancode *key) {
   // xprintf("Updating report for %d", key->keycode);
   uint16_t keycode = consumer_mapping[key->keycode - 0xe8];
@@ -354,8 +702,18 @@ void update_consumer_report(queuedScancode *key) {
   } else {
     consumer_release(keycode);
   }
-  memcpy(CONSUMER_OUTBOX, consumer_report, OUTBOX_SIZE(CONSUMER_OUTBOX));
-  USB_SEND_REPORT(CONSUMER);
+  mark_unsent(CONSUMER_REPORT, key->keycode);
+  if (reports_held) {
+    SET_BIT(reports_pending, PENDING_CONSUMER);
+  } else {
+    send_consumer_report();
+  }
+}
+
+static void send_system_report(void) {
+  memcpy(SYSTEM_OUTBOX, system_report, OUTBOX_SIZE(SYSTEM_OUTBOX));
+  // xprintf("System: %d", SYSTEM_OUTBOX[0]);
+  USB_SEND_REPORT(SYSTEM);
 }
 
 void update_system_report(queuedScancode *key) {
@@ -365,9 +723,30 @@ void update_system_report(queuedScancode *key) {
   } else {
     system_report[0] &= ~(1 << keyIndex);
   }
-  memcpy(SYSTEM_OUTBOX, system_report, OUTBOX_SIZE(SYSTEM_OUTBOX));
-  // xprintf("System: %d", SYSTEM_OUTBOX[0]);
-  USB_SEND_REPORT(SYSTEM);
+  mark_unsent(SYSTEM_REPORT, key->keycode);
+  if (reports_held) {
+    SET_BIT(reports_pending, PENDING_SYSTEM);
+  } else {
+    send_system_report();
+  }
+}
+
+void usb_hold_reports(void) {
+  reports_held = true;
+}
+
+void usb_release_reports(void) {
+  reports_held = false;
+  if (TEST_BIT(reports_pending, PENDING_KBD)) {
+    send_keyboard_report();
+  }
+  if (TEST_BIT(reports_pending, PENDING_CONSUMER)) {
+    send_consumer_report();
+  }
+  if (TEST_BIT(reports_pending, PENDING_SYSTEM)) {
+    send_system_report();
+  }
+  reports_pending = 0;
 }
 
 void usb_suspend_monitor_start(void) {
@@ -385,7 +764,6 @@ void usb_suspend_monitor_stop(void) {
 
 void usb_init(void) {
   memset(keyboard_report.raw, 0, sizeof keyboard_report.raw);
-  keyboard_report_usage = 0;
   memset(consumer_report, 0, sizeof consumer_report);
 #ifndef SELF_POWERED
   USB_Start(0u, USB_5V_OPERATION);
@@ -396,6 +774,13 @@ void usb_configure(void) {
   memset(KBD_OUTBOX, 0, sizeof(KBD_OUTBOX));
   memset(CONSUMER_OUTBOX, 0, sizeof(CONSUMER_OUTBOX));
   memset(SYSTEM_OUTBOX, 0, sizeof(SYSTEM_OUTBOX));
+  // New configuration - host has nothing, and nothing old should reach it.
+  for (uint8_t i = 0; i < USB_REPORTS; i++) {
+    UsbReportSlot_t *slot = &usbReports[i];
+    slot->pending = false;
+    slot->sent_len = 0;
+    memset(slot->unsent, 0, sizeof slot->unsent);
+  }
   if (0u == USB_GetConfiguration()) {
     // This never happens. But let's handle it just in case.
     usb_status = USB_STATUS_DISCONNECTED;
@@ -448,26 +833,13 @@ void usb_tick(void) {
     exp_setLEDs(led_status);
   }
   CyExitCriticalSection(enableInterrupts);
-  usbSend();
-}
-
-#define RESET_SINGLE(R, O)                                                     \
-  memset(R, 0, sizeof R);                                                      \
-  if (memcmp(R, O##_OUTBOX, OUTBOX_SIZE(O##_OUTBOX)) != 0) {                   \
-    memset(O##_OUTBOX, 0, OUTBOX_SIZE(O##_OUTBOX));                            \
-    USB_SEND_REPORT(O);                                                        \
+  if (USB_GetProtocol(KBD_INTERFACE) != kbd_protocol) {
+    // SET_PROTOCOL - host drops what it had, give it held keys in new format.
+    send_keyboard_report();
   }
-
-/*
- * updates host only if there were stuck keys, to avoid N reports on every "last
- * key depressed".
- */
-void reset_reports(void) {
-  RESET_SINGLE(keyboard_report.raw, KBD)
-  keyboard_report_usage = 0;
-  RESET_SINGLE(consumer_report, CONSUMER)
-  RESET_SINGLE(system_report, SYSTEM)
-  // xprintf("reports reset");
+  config_bulk_tick();
+  log_drain();
+  usbSend();
 }
 
 void usb_nap(void) {
@@ -557,11 +929,3 @@ void USB_DP_ISR_EntryCallback(void) {
   }
   power_state = DEVSTATE_RESUMING;
 }
-
-void xprintf(const char *format_p, ...) {
-  va_list va;
-  va_start(va, format_p);
-  vsnprintf((char *)outbox.raw, sizeof(outbox), format_p, va);
-  va_end(va);
-  usb_send_c2();
-}
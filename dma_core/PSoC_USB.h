@@ -15,28 +15,40 @@
 
 
 /*
- * Internal state storage. Must be longer than conceivable number of
- * simultaneously pressed keys. USB HID spec requires whole report to say
- * "Keyboard Rollover Error" when it happens. OS (Windows at least) will
- * maintain last known state before KRO. Currently there's a semi-bug - if you
- * set KRO lower than OUTBOX_SIZE, you'll see keycodes beyond KRO limit. It's a
- * semi-bug because you're supposed to set KRO limit to match your packet size -
- * hence match OUTBOX_SIZE.
+ * Internal state storage, also the report protocol report as is - bit per
+ * usage, so no rollover. Boot protocol report is built from it on send, and
+ * says "Keyboard Rollover Error" in all slots past KBD_BOOT_KEYS keys, as USB
+ * HID spec requires.
  */
 union {
   struct {
     uint8_t mods;
     uint8_t reserved;
-    uint8_t keys[MAX_KEYS];
+    uint8_t keys[KBD_USAGES / 8];
   } __attribute__((packed));
-  uint8_t raw[MAX_KEYS + 2];
+  uint8_t raw[KBD_USAGES / 8 + 2];
 } keyboard_report;
-uint8_t keyboard_report_usage;
 
 // Consumer or system reports are not expected to be tested to KRO limit.
 uint16_t consumer_report[CONSUMER_KRO_LIMIT];
 uint8_t system_report[OUTBOX_SIZE(SYSTEM_OUTBOX)];
 
+/*
+ * First event played into reports being built. Next report enqueued takes it
+ * along, so USB_LoadInEP can be timed against it.
+ */
+typedef struct {
+  bool valid;
+  uint64_t detected;
+  uint64_t played;
+} latency_tag_t;
+latency_tag_t report_tag;
+
+enum { KBD_REPORT, CONSUMER_REPORT, SYSTEM_REPORT, USB_REPORTS };
+void usb_send_report(uint8_t report, uint8_t len);
+// Keycode's last change hasn't reached the host - its next one has to wait.
+bool usb_usage_unsent(uint8_t keycode);
+
 void usb_init(void);
 void usb_configure(void);
 void usb_tick(void);
@@ -46,12 +58,14 @@ void usb_wake(void);
 
 void usb_send_c2();
 void usb_send_c2_blocking();
+bool usb_c2_idle(void);
 void usb_send_wakeup(void);
 void usb_receive(OUT_c2packet_t *);
 void load_config(void);
 void apply_config(void);
 
-void reset_reports();
+void usb_hold_reports(void);
+void usb_release_reports(void);
 void update_keyboard_report(queuedScancode *key);
 void update_consumer_report(queuedScancode *key);
 void update_system_report(queuedScancode *key);
@@ -64,4 +78,4 @@ void update_system_report(queuedScancode *key);
 
 #define USB_SEND_REPORT(TYPE)                                                  \
   _WIPE_OUTBOX(TYPE##_OUTBOX);                                                 \
-  usbEnqueue(TYPE##_EP, OUTBOX_SIZE(TYPE##_OUTBOX), TYPE##_OUTBOX);
+  usb_send_report(TYPE##_REPORT, OUTBOX_SIZE(TYPE##_OUTBOX));
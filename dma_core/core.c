@@ -31,6 +31,51 @@ CY_ISR(Timer_ISR) {
   systime++;
 }
 
+// SysTick runs off CPU clock with 1ms period - count those, rest is in SysTick.
+// 32 bits of milliseconds would wrap in 49.7 days, so it's 64.
+volatile uint64_t timestamp_ms;
+
+void SysTick_Callback(void) {
+  timestamp_ms++;
+}
+
+uint64_t timestamp_us(void) {
+  uint64_t ms;
+  uint32_t ticks;
+  // SysTick is the top priority exception, so rereading is enough to get
+  // both halves of ms and a matching SysTick value.
+  do {
+    ms = timestamp_ms;
+    ticks = CySysTickGetValue();
+  } while (ms != timestamp_ms);
+  if (SCB->ICSR & SCB_ICSR_PENDSTSET_Msk) {
+    // Interrupts are masked and SysTick has reloaded - callback hasn't
+    // counted that millisecond yet. The value read may be from either side
+    // of the reload, so read it again.
+    ms++;
+    ticks = CySysTickGetValue();
+  }
+  return MS_TO_US(ms) +
+         (CySysTickGetReload() - ticks) / (BCLK__BUS_CLK__HZ / 1000000u);
+}
+
+uint32_t cycles_since(uint32_t started) {
+  uint32_t now = CySysTickGetValue();
+  // SysTick counts down and wraps every 1ms.
+  return (started >= now) ? started - now
+                          : started + CySysTickGetReload() + 1 - now;
+}
+
+void latency_record(uint8_t stage, uint32_t us) {
+  uint8_t bucket = (us == 0) ? 0 : 32 - __builtin_clz(us);
+  if (bucket >= LATENCY_BUCKETS) {
+    bucket = LATENCY_BUCKETS - 1;
+  }
+  if (latency[stage][bucket] < UINT16_MAX) {
+    latency[stage][bucket]++;
+  }
+}
+
 inline void setup() {
 #ifdef EXTERNAL_CORE_POWER
   // Disable core internal LDOs.
@@ -42,6 +87,8 @@ inline void setup() {
   BootIRQ_StartEx(BootIRQ_ISR);
   SysTimer_Start();
   TimerIRQ_StartEx(Timer_ISR);
+  CySysTickStart();
+  CySysTickSetCallback(0, SysTick_Callback);
   
   load_config();
 
@@ -71,14 +118,25 @@ inline void main_loop() {
         scan_tick();
         if (TEST_BIT(status_register, C2DEVSTATUS_MATRIX_MONITOR)) {
           report_matrix_readouts();
-        } else if (TEST_BIT(status_register, C2DEVSTATUS_OUTPUT_ENABLED)) {
+        }
+        if (TEST_BIT(status_register, C2DEVSTATUS_OUTPUT_ENABLED)) {
           pipeline_process();
         }
+      } else if (pipeline_pending) {
+        pipeline_pending = false;
+        if (TEST_BIT(status_register, C2DEVSTATUS_OUTPUT_ENABLED)) {
+          pipeline_process_events();
+        }
       }
       serial_tick();
       usb_tick();
-      // Timer ISR will wake us up.
-      CyPmAltAct(PM_ALT_ACT_TIME_NONE, PM_ALT_ACT_SRC_NONE);
+      // Timer or scanner ISR will wake us up. Interrupts off so neither can
+      // slip in between the check and WFI - pending IRQ still wakes the core.
+      uint8_t enableInterrupts = CyEnterCriticalSection();
+      if (tick == 0 && !pipeline_pending) {
+        CyPmAltAct(PM_ALT_ACT_TIME_NONE, PM_ALT_ACT_SRC_NONE);
+      }
+      CyExitCriticalSection(enableInterrupts);
       break;
     case DEVSTATE_PREPARING_TO_SLEEP:
       if (tick) {
@@ -56,14 +56,19 @@
  *
  * The BIOS will ignore any extensions to reports.
  * -- Same place.
+ *
+ * So boot protocol gets mods, reserved byte and 6 keys. Report protocol gets
+ * mods, reserved byte and a bit per usage - see Keyboard.hid.xml.
  */
-#define MAX_KEYS 126
+#define KBD_USAGES 0xe0 // Everything below modifiers. 0xa5-0xaf never get set.
+#define KBD_BOOT_KEYS 6
+#define KBD_BOOT_REPORT_SIZE (KBD_BOOT_KEYS + 2)
 
 // USB stuff
 #define USB_REMOTE_WAKEUP
 
-#define KBD_KRO_LIMIT 62
 #define KBD_EP 1
+#define KBD_INTERFACE 0
 #define KBD_SCB USB_DEVICE0_CONFIGURATION0_INTERFACE0_ALTERNATE0_HID_OUT_RPT_SCB
 #define KBD_INBOX USB_DEVICE0_CONFIGURATION0_INTERFACE0_ALTERNATE0_HID_OUT_BUF
 #define KBD_OUTBOX USB_DEVICE0_CONFIGURATION0_INTERFACE0_ALTERNATE0_HID_IN_BUF
@@ -86,6 +91,10 @@
 
 IN_c2packet_t outbox;
 
+perf_counters_t perf;
+uint16_t latency[LATENCY_STAGES][LATENCY_BUCKETS];
+void latency_record(uint8_t stage, uint32_t us);
+
 // EEPROM stuff
 psoc_eeprom_t config;
 
@@ -96,7 +105,15 @@ psoc_eeprom_t config;
 
 // Modified by ISR!
 volatile uint8_t tick;
+// New scancodes are in - main loop runs the pipeline without waiting for tick.
+volatile bool pipeline_pending;
 volatile uint32_t systime;
+// Microseconds since start, from SysTick. Safe to call from ISRs. Never
+// wraps - timestamps are kept at this width everywhere, no truncation.
+uint64_t timestamp_us(void);
+// CPU cycles since SysTick read `started`. Only good for spans under 1ms.
+uint32_t cycles_since(uint32_t started);
+#define MS_TO_US(X) ((uint64_t)(X) * 1000)
 
 enum devicePowerStates {
   DEVSTATE_FULL_THROTTLE = 1, // Going full bore
@@ -124,7 +141,14 @@ enum outputDirection {
   OUTPUT_DIRECTION_MAX
 };
 
-void xprintf(const char *format_p, ...);
+/*
+ * Binary log, see LOG_MESSAGES. LOG(LOG_X, args...) - up to LOG_MAX_ARGS
+ * 32-bit arguments. No formatting on the device, safe from any context.
+ */
+void log_event(uint8_t argc, uint8_t id, ...);
+#define LOG_ARGC_(_1, _2, _3, _4, _5, _6, N, ...) N
+#define LOG(...)                                                               \
+  log_event(LOG_ARGC_(__VA_ARGS__, 5, 4, 3, 2, 1, 0), __VA_ARGS__)
 
 #if SWITCH_TYPE == BEAMSPRING
 #define SCANNER_TYPE SCANNER_CS
@@ -16,88 +16,238 @@
 #include "sup_serial.h"
 
 uint8_t pipeline_prev_usbkey;
-uint32_t pipeline_prev_usbkey_time;
+uint64_t pipeline_prev_usbkey_time;
+// Scancode being processed - everything it queues is timed from there.
+uint64_t pipeline_detected_at;
+uint64_t pipeline_picked_at;
 
-inline void process_layerMods(uint8_t sc, uint8_t keycode) {
+inline uint8_t resolve_keycode(uint8_t layer, uint8_t scancode) {
+  for (; layer > 0; layer--) {
+    if (config.layers[layer][scancode] != USBCODE_TRANSPARENT) {
+      break;
+    }
+  }
+  return config.layers[layer][scancode];
+}
+
+inline void keymap_rebuild_slice(void) {
+  if (keymap_valid >= COMMONSENSE_MATRIX_SIZE) {
+    return;
+  }
+  uint32_t started = CySysTickGetValue();
+  uint16_t end = keymap_valid + KEYMAP_REBUILD_SLICE;
+  if (end > COMMONSENSE_MATRIX_SIZE) {
+    end = COMMONSENSE_MATRIX_SIZE;
+  }
+  for (; keymap_valid < end; keymap_valid++) {
+    keymap[keymap_valid] = resolve_keycode(keymap_layer, keymap_valid);
+  }
+  uint32_t cycles = cycles_since(started);
+  if (cycles > perf.keymapMaxCycles) {
+    perf.keymapMaxCycles = cycles;
+  }
+}
+
+inline void keymap_select(uint8_t layer) {
+  if (layer != keymap_layer) {
+    keymap_layer = layer;
+    keymap_valid = 0;
+    keymap_rebuild_slice();
+  }
+}
+
+inline uint8_t keymap_lookup(uint8_t scancode) {
+  if (scancode < keymap_valid) {
+    return keymap[scancode];
+  }
+  return resolve_keycode(keymap_layer, scancode);
+}
+
+inline void process_layerMods(uint8_t flags, uint8_t keycode) {
   // codes A8-AB - momentary selection, AC-AF - permanent
   if (keycode & 0x04) {
-    if ((sc & KEY_UP_MASK) == 0) {
+    if ((flags & KEY_UP_MASK) == 0) {
       // Press
       currentLayer = keycode & 0x03;
+      keymap_select(currentLayer);
     }
     // Release is ignored
   } else {
-    if ((sc & KEY_UP_MASK) == 0) {
+    if ((flags & KEY_UP_MASK) == 0) {
       // Press
-      layerMods |= (1 << ((keycode & 0x03) + LAYER_MODS_SHIFT));
+      fnState |= (1 << (keycode & 0x03));
     } else {
       // Release
-      layerMods &= ~(1 << ((keycode & 0x03) + LAYER_MODS_SHIFT));
+      fnState &= ~(1 << (keycode & 0x03));
     }
     // Figure layer condition
-    for (uint8_t i = 0; i < sizeof(config.layerConditions); i++) {
-      if (layerMods == (config.layerConditions[i] & 0xf0)) {
-        currentLayer = (config.layerConditions[i] & 0x0f);
-        break;
-      }
+    uint8_t layer = layer_table[fnState];
+    if (layer != LAYER_NO_CHANGE) {
+      currentLayer = layer;
+      keymap_select(currentLayer);
     }
   }
 }
 
+static void compile_layer_conditions(void) {
+  memset(layer_table, LAYER_NO_CHANGE, sizeof layer_table);
+  // First matching condition wins - so going backwards, earlier overwrite.
+  uint8_t *c = config.layerConditions + sizeof(config.layerConditions);
+  while (c > config.layerConditions) {
+    c -= LAYER_CONDITION_BYTES;
+    layer_table[LAYER_CONDITION_FN(c)] = LAYER_CONDITION_LAYER(c);
+  }
+}
+
 /*
  * Data structure: [scancode][flags][data length][macro data]
+ * Builds macro index. First macro for a key wins - same as linear walk did.
  */
+static void index_macros(void) {
+  memset(macro_bitmap, 0, sizeof macro_bitmap);
+  macro_index_count = 0;
+  for (uint_fast16_t ptr = 0; ptr + 2 < sizeof config.macros &&
+                              config.macros[ptr] != EMPTY_FLASH_BYTE;
+       ptr += config.macros[ptr + 2] + 3) {
+    uint16_t key = MACRO_INDEX_KEY(config.macros[ptr + 1], config.macros[ptr]);
+    if (TEST_BIT(macro_bitmap[key / 32], key % 32)) {
+      continue;
+    }
+    SET_BIT(macro_bitmap[key / 32], key % 32);
+    uint16_t pos = macro_index_count++;
+    for (; pos > 0 && macro_index[pos - 1].key > key; pos--) {
+      macro_index[pos] = macro_index[pos - 1];
+    }
+    macro_index[pos].key = key;
+    macro_index[pos].ptr = ptr;
+  }
+}
+
 inline uint_fast16_t lookup_macro(uint8_t flags, uint8_t keycode) {
-  uint_fast16_t ptr = 0;
-  do {
 #if USBQUEUE_RELEASED_MASK != MACRO_TYPE_ONKEYUP
 #error Please rewrite check below - it is no longer valid
 #endif
-    if (config.macros[ptr] == keycode &&
-        (flags & USBQUEUE_RELEASED_MASK) ==
-            (config.macros[ptr + 1] & MACRO_TYPE_ONKEYUP)) {
-      return ptr;
+  uint16_t key = MACRO_INDEX_KEY(flags, keycode);
+  if (!TEST_BIT(macro_bitmap[key / 32], key % 32)) {
+    return MACRO_NOT_FOUND;
+  }
+  uint16_t lo = 0;
+  uint16_t hi = macro_index_count;
+  while (lo < hi) {
+    uint16_t mid = (lo + hi) / 2;
+    if (macro_index[mid].key < key) {
+      lo = mid + 1;
     } else {
-      ptr += config.macros[ptr + 2] + 3;
+      hi = mid;
     }
-  } while (ptr < sizeof config.macros &&
-           config.macros[ptr] != EMPTY_FLASH_BYTE);
-  return MACRO_NOT_FOUND;
+  }
+  return macro_index[lo].ptr;
 }
 
-inline void queue_usbcode(uint32_t time, uint8_t flags, uint8_t keycode) {
-  // Trick - even if current buffer position is empty, write to the next one.
-  // It may be empty because reader already processed it.
-  USBQueue_writepos = KEYCODE_BUFFER_NEXT(USBQueue_writepos);
-  // Make sure not to overwrite pending events - TODO think how not to fall into
-  // infinite loop if buffer full.
-  while (USBQueue[USBQueue_writepos].keycode != USBCODE_NOEVENT) {
-    USBQueue_writepos = KEYCODE_BUFFER_NEXT(USBQueue_writepos);
-  }
-  USBQueue[USBQueue_writepos].sysTime = time;
-  USBQueue[USBQueue_writepos].flags = flags;
-  USBQueue[USBQueue_writepos].keycode = keycode;
+inline bool usbqueue_before(uint8_t a, uint8_t b) {
+  if (USBQueue[a].event.sysTime != USBQueue[b].event.sysTime) {
+    return USBQueue[a].event.sysTime < USBQueue[b].event.sysTime;
+  }
+  // Never more than USBQUEUE_SIZE apart - wraparound is fine.
+  return (int16_t)(USBQueue[a].seq - USBQueue[b].seq) < 0;
 }
 
-inline void play_macro(uint_fast16_t macro_start) {
-  uint8_t *mptr = &config.macros[macro_start] + 3;
-  uint8_t *macro_end = mptr + config.macros[macro_start + 2];
-  uint32_t now = systime;
-  uint_fast16_t delay;
+inline void usbqueue_swap(uint8_t a, uint8_t b) {
+  usbqueue_entry_t tmp = USBQueue[a];
+  USBQueue[a] = USBQueue[b];
+  USBQueue[b] = tmp;
+}
+
+inline void queue_usbcode(uint64_t time, uint8_t flags, uint8_t keycode) {
+  if (keycode == USBCODE_NOEVENT) {
+    return;
+  }
+  if (USBQueue_count == USBQUEUE_SIZE) {
+    // Full - drop the newcomer rather than something already promised.
+    perf.usbQueueOverflows++;
+    return;
+  }
+  uint64_t now = timestamp_us();
+  latency_record(LATENCY_QUEUE, now - pipeline_picked_at);
+  uint8_t pos = USBQueue_count++;
+  USBQueue[pos].event.sysTime = time;
+  USBQueue[pos].event.flags = flags;
+  USBQueue[pos].event.keycode = keycode;
+  USBQueue[pos].seq = USBQueue_seq++;
+  USBQueue[pos].detected = pipeline_detected_at;
+  USBQueue[pos].queued = now;
+  while (pos > 0 && usbqueue_before(pos, (pos - 1) / 2)) {
+    usbqueue_swap(pos, (pos - 1) / 2);
+    pos = (pos - 1) / 2;
+  }
+  if (USBQueue_count > perf.usbQueueHighWater) {
+    perf.usbQueueHighWater = USBQueue_count;
+  }
+}
+
+inline queuedScancode dequeue_usbcode(void) {
+  queuedScancode result = USBQueue[0].event;
+  USBQueue[0] = USBQueue[--USBQueue_count];
+  uint8_t pos = 0;
+  for (;;) {
+    uint8_t first = pos;
+    uint8_t child = pos * 2 + 1;
+    if (child < USBQueue_count && usbqueue_before(child, first)) {
+      first = child;
+    }
+    child++;
+    if (child < USBQueue_count && usbqueue_before(child, first)) {
+      first = child;
+    }
+    if (first == pos) {
+      break;
+    }
+    usbqueue_swap(pos, first);
+    pos = first;
+  }
+  return result;
+}
+
+/*
+ * Runs the macro until it has to wait, queued MACRO_STEP_EVENTS events or
+ * USBQueue is down to the reserve. Events are timed by schedule, not by when
+ * they got queued, so pauses don't stretch the macro.
+ */
+inline void macro_step(macro_context_t *ctx) {
+  uint64_t now = timestamp_us();
+  uint8_t events = 0;
+  uint8_t *mptr;
   uint8_t keyflags;
-  while (mptr <= macro_end) {
-    delay = config.delayLib[(*mptr >> 2) & 0x0f];
+  pipeline_detected_at = ctx->detected;
+  pipeline_picked_at = ctx->picked;
+  while (ctx->wakeup <= now) {
+    if (events == MACRO_STEP_EVENTS ||
+        USBQueue_count >= USBQUEUE_SIZE - MACRO_QUEUE_RESERVE) {
+      return;
+    }
+    if (ctx->releasing) {
+      queue_usbcode(ctx->wakeup, USBQUEUE_RELEASED_MASK, ctx->release);
+      ctx->releasing = false;
+      events++;
+      continue;
+    }
+    if (ctx->pc >= ctx->end) {
+      ctx->active = false;
+      return;
+    }
+    mptr = &config.macros[ctx->pc];
+    uint64_t delay = MS_TO_US(config.delayLib[(*mptr >> 2) & 0x0f]);
     switch (*mptr >> 6) {
     // Check first 2 bits - macro command
     case 0: // TypeOneKey
       // Press+release, timing from delayLib
-      mptr++;
-      // FIXME possible to queue USB_NOEVENT.
-      // This will most likely trigger exp. header, but may be as bad as
-      // infinite loop.
-      queue_usbcode(now, 0, *mptr);
-      now += delay;
-      queue_usbcode(now, USBQUEUE_RELEASED_MASK, *mptr);
+      // USB_NOEVENT is silently dropped by queue_usbcode.
+      queue_usbcode(ctx->wakeup, 0, mptr[1]);
+      ctx->release = mptr[1];
+      ctx->releasing = true;
+      ctx->wakeup += delay;
+      ctx->pc += 2;
+      events++;
       break;
     case 1: // ChangeMods - currently PressKey and ReleaseKey
       /*
@@ -109,13 +259,15 @@ inline void play_macro(uint_fast16_t macro_start) {
        */
       keyflags =
           (*mptr & MACRO_KEY_UPDOWN_RELEASE) ? USBQUEUE_RELEASED_MASK : 0;
-      mptr++;
-      queue_usbcode(now, keyflags, *mptr);
-      now += delay;
+      queue_usbcode(ctx->wakeup, keyflags, mptr[1]);
+      ctx->wakeup += delay;
+      ctx->pc += 2;
+      events++;
       break;
     case 2: // Mods stack manipulation
       // 2 bits - PushMods, PopMods, RevertMods.
       // Not used currently.
+      ctx->pc++;
       break;
     case 3: // Wait
       /* 4 bits for delay. Initially had special value of 
@@ -123,15 +275,49 @@ inline void play_macro(uint_fast16_t macro_start) {
        * But since now we have separate triggers on press and release - all
        * values are from delayLib.
        */
-      now += delay;
+      ctx->wakeup += delay;
+      ctx->pc++;
       break;
-    default:
-      return;
     }
-    mptr++;
   }
 }
 
+inline void play_macro(uint_fast16_t macro_start) {
+  for (uint8_t i = 0; i < MACRO_CONTEXTS; i++) {
+    macro_context_t *ctx = &macro_contexts[i];
+    if (ctx->active) {
+      continue;
+    }
+    ctx->active = true;
+    ctx->releasing = false;
+    ctx->pc = macro_start + 3;
+    ctx->end = ctx->pc + config.macros[macro_start + 2];
+    ctx->wakeup = timestamp_us();
+    ctx->detected = pipeline_detected_at;
+    ctx->picked = pipeline_picked_at;
+    macro_step(ctx);
+    return;
+  }
+  perf.macroOverflows++;
+}
+
+inline void run_macros(void) {
+  for (uint8_t i = 0; i < MACRO_CONTEXTS; i++) {
+    if (macro_contexts[i].active) {
+      macro_step(&macro_contexts[i]);
+    }
+  }
+}
+
+inline bool macros_playing(void) {
+  for (uint8_t i = 0; i < MACRO_CONTEXTS; i++) {
+    if (macro_contexts[i].active) {
+      return true;
+    }
+  }
+  return false;
+}
+
 inline scancode_t process_scancode_buffer(void) {
   if (scancode_buffer_readpos == scancode_buffer_writepos) {
     scancode_t result;
@@ -149,13 +335,10 @@ inline scancode_t process_scancode_buffer(void) {
   }
   scancode_t scancode = scancode_buffer[scancode_buffer_readpos];
 #ifdef MATRIX_LEVELS_DEBUG
-  xprintf("sc: %d %d @ %d ms, lvl %d/%d", scancode & KEY_UP_MASK,
-          scancode & SCANCODE_MASK, systime,
-          level_buffer[scancode_buffer_readpos],
-          level_buffer_inst[scancode_buffer_readpos]);
-#else
-// xprintf("sc: %d %d @ %d ms", scancode & KEY_UP_MASK, scancode &SCANCODE_MASK,
-// systime);
+  LOG(LOG_SCANCODE_LEVELS, scancode.flags & USBQUEUE_RELEASED_MASK,
+      scancode.scancode, (uint32_t)(scancode.time / 1000),
+      level_buffer[scancode_buffer_readpos],
+      level_buffer_inst[scancode_buffer_readpos]);
 #endif
   scancode_buffer[scancode_buffer_readpos].flags = 0;
   scancode_buffer[scancode_buffer_readpos].scancode = COMMONSENSE_NOKEY;
@@ -174,22 +357,23 @@ inline void process_real_key(void) {
   sc = process_scancode_buffer();
   if (sc.scancode == COMMONSENSE_NOKEY) {
     if ((sc.flags & KEY_UP_MASK)) {
-      if (!USBQUEUE_IS_EMPTY) {
+      if (!USBQUEUE_IS_EMPTY || macros_playing()) {
         push_back_scancode(sc);
       } else {
         /*
          * This is "All keys are up" signal, sun keyboard-style.
-         * It is used to deal with stuck keys. Those appear due to layers - suppose
-         * you press the key, then switch layer which has another key at that SC
-         * position. When you release the key - non-existent key release is
-         * generated, which is not that bad, but first key is stuck forever.
+         * Releases go to what was pressed, so layers can't leave keys stuck
+         * anymore - but a macro still can press and never release.
          */
-        reset_reports();
-        serial_reset_reports();
+        release_pressed_usages();
+        memset(pressed_keys, 0, sizeof pressed_keys);
       }
     }
     return;
   }
+  pipeline_detected_at = sc.time;
+  pipeline_picked_at = timestamp_us();
+  latency_record(LATENCY_PICKUP, pipeline_picked_at - pipeline_detected_at);
   if (TEST_BIT(status_register, C2DEVSTATUS_SETUP_MODE)) {
     outbox.response_type = C2RESPONSE_SCANCODE;
     outbox.payload[0] = sc.flags;
@@ -197,12 +381,14 @@ inline void process_real_key(void) {
     usb_send_c2();
     return;
   }
-  // Resolve USB keycode using current active layers
-  for (uint8_t i = currentLayer; i >= 0; i--) {
-    usb_sc = config.layers[i][sc.scancode];
-    if (usb_sc != USBCODE_TRANSPARENT) {
-      break;
-    }
+  if (sc.flags & KEY_UP_MASK) {
+    // Whatever layer is active now - release what was pressed.
+    usb_sc = pressed_keys[sc.scancode].usage;
+    pressed_keys[sc.scancode].usage = USBCODE_TRANSPARENT;
+  } else {
+    usb_sc = keymap_lookup(sc.scancode);
+    pressed_keys[sc.scancode].usage = usb_sc;
+    pressed_keys[sc.scancode].layer = currentLayer;
   }
   // xprintf("SC->KC: %d -> %d", sc, usb_sc);
   if (usb_sc < USBCODE_A) {
@@ -213,7 +399,7 @@ inline void process_real_key(void) {
     return;
   }
   if ((usb_sc & 0xf8) == 0xa8) {
-    process_layerMods(sc.scancode, usb_sc);
+    process_layerMods(sc.flags, usb_sc);
     return;
     /*
     TODO resolve problem where pressed mod keys are missing on the new layer.
@@ -231,13 +417,14 @@ inline void process_real_key(void) {
     // late.
     do_queue = true;
     if ((usb_sc != pipeline_prev_usbkey) ||
-        (pipeline_prev_usbkey_time + config.delayLib[DELAYS_TAP] < systime)) {
+        (pipeline_prev_usbkey_time + MS_TO_US(config.delayLib[DELAYS_TAP]) <
+         sc.time)) {
       // Nope!
       do_play = false;
     }
   }
   pipeline_prev_usbkey = usb_sc;
-  pipeline_prev_usbkey_time = systime;
+  pipeline_prev_usbkey_time = sc.time;
   /*
   NOTE: queue_usbcode skips non-zero cells in the buffer. Think what to do on
   overflow. NOTE2: we still want to maintain order? Otherwise linked list is
@@ -245,106 +432,150 @@ inline void process_real_key(void) {
   management)
   */
   if (do_queue)
-    queue_usbcode(systime, keyflags, usb_sc);
+    queue_usbcode(sc.time, keyflags, usb_sc);
   if (do_play)
     play_macro(macro_ptr);
   return;
 }
 
-#define NO_COOLDOWN USBQueue[pos].flags |= USBQUEUE_RELEASED_MASK;
+#define NO_COOLDOWN key->flags |= USBQUEUE_RELEASED_MASK;
+inline void play_usbcode(queuedScancode *key) {
+  if (key->keycode >= USBCODE_A) {
+    FORCE_BIT(pressed_usages[key->keycode / 32], key->keycode % 32,
+              (key->flags & USBQUEUE_RELEASED_MASK) == 0);
+  }
+  if (key->keycode < USBCODE_A) {
+    // side effect - key transparent till the bottom will toggle exp. header
+    // But it should not ever be put on queue!
+    exp_toggle();
+    NO_COOLDOWN
+  }
+  // Codes you want filtered from reports MUST BE ABOVE THIS LINE!
+  // -> Think of special code for collectively settings mods!
+  else if (key->keycode >= 0xe8) {
+    update_consumer_report(key);
+  } else if (key->keycode >= 0xa5 && key->keycode <= 0xa7) {
+    update_system_report(key);
+  } else {
+    switch (output_direction) {
+      case OUTPUT_DIRECTION_USB:
+        update_keyboard_report(key);
+        break;
+      case OUTPUT_DIRECTION_SERIAL:
+        update_serial_keyboard_report(key);
+        break;
+      default:
+        break;
+    }
+  }
+  if ((key->flags & USBQUEUE_RELEASED_MASK) == 0) {
+    // We only throttle keypresses. Key release doesn't slow us down -
+    // minimum duration is guaranteed by fact that key release goes after
+    // key press and keypress triggers cooldown.
+    cooldown_timer = config.delayLib[DELAYS_EVENT]; // Actual update
+                                                    // happened - reset
+                                                    // cooldown.
+    exp_keypress(key->keycode); // Let the downstream filter by keycode
+  }
+}
+
 /*
-    Idea: not move readpos until keycode after it is processed.
-    So, readpos to writepos would be the working area.
+    Due events, earliest first. One per call - or, with CSF_COALESCE, all that
+    are due, applied together so each report goes out once. Press and release
+    of the same key still never share a report - second one waits until the
+    endpoint has taken the first (usb_usage_unsent).
+ */
+inline void play_next_usbcode(void) {
+  uint64_t now = timestamp_us();
+  latency_record(LATENCY_REPORT, now - USBQueue[0].queued);
+  if (!report_tag.valid) {
+    report_tag.valid = true;
+    report_tag.detected = USBQueue[0].detected;
+    report_tag.played = now;
+  }
+  queuedScancode key = dequeue_usbcode();
+  play_usbcode(&key);
+}
 
-    TODO: maintain bitmap of currently pressed keys to release them on reset and
-   for better KRO handling.
-    TODO: implement out of order key release?
-    NOTE ^ ^^ very rare situations where this is needed.
+/*
+ * Releases whatever is still down, in one report per type. Nothing is sent
+ * when nothing is stuck.
  */
+inline void release_pressed_usages(void) {
+  queuedScancode key;
+  key.sysTime = timestamp_us();
+  key.flags = USBQUEUE_RELEASED_MASK;
+  usb_hold_reports();
+  for (uint8_t i = 0; i < sizeof pressed_usages / sizeof pressed_usages[0];
+       i++) {
+    while (pressed_usages[i]) {
+      key.keycode = i * 32 + __builtin_ctz(pressed_usages[i]);
+      play_usbcode(&key); // clears the bit
+    }
+  }
+  usb_release_reports();
+}
+
 inline void update_reports(void) {
-  if (cooldown_timer > 0) {
-    // Slow down! Delay 0 controls update rate.
-    // we should be called every millisecond - so setting delay0 to 10 will
-    // essentially makes it 100Hz keyboard with latency of 1kHz one.
-    cooldown_timer--;
-    return;
+  if (release_pending) {
+    release_pending = false;
+    release_pressed_usages();
   }
-  if (USBQUEUE_IS_EMPTY) {
+  uint64_t now = timestamp_us();
+  if (USBQUEUE_IS_EMPTY || USBQueue[0].event.sysTime > now ||
+      usb_usage_unsent(USBQueue[0].event.keycode)) {
     return;
   }
-  // If there's change - find first non-empty buffer cell.
-  // This results in infinite loop on empty buffer - must take care not to queue
-  // NOEVENTs.
-  while (USBQueue[USBQueue_readpos].keycode == USBCODE_NOEVENT) {
-    USBQueue_readpos = KEYCODE_BUFFER_NEXT(USBQueue_readpos);
+  if (!TEST_BIT(config.capsenseFlags, CSF_COALESCE)) {
+    play_next_usbcode();
+    // Went to serial or exp header - no report to tag.
+    report_tag.valid = false;
+    return;
   }
-  // xprintf("USB queue %d - %d", USBQueue_readpos, USBQueue_writepos);
-  uint8_t pos = USBQueue_readpos;
+  uint32_t touched[256 / 32];
+  memset(touched, 0, sizeof touched);
+  usb_hold_reports();
   do {
-    if (USBQueue[pos].keycode != USBCODE_NOEVENT &&
-        USBQueue[pos].sysTime <= systime) {
-      if (USBQueue[pos].keycode < USBCODE_A) {
-        // side effect - key transparent till the bottom will toggle exp. header
-        // But it should not ever be put on queue!
-        exp_toggle();
-        NO_COOLDOWN
-      }
-      // Codes you want filtered from reports MUST BE ABOVE THIS LINE!
-      // -> Think of special code for collectively settings mods!
-      else if (USBQueue[pos].keycode >= 0xe8) {
-        update_consumer_report(&USBQueue[pos]);
-      } else if (USBQueue[pos].keycode >= 0xa5 &&
-                 USBQueue[pos].keycode <= 0xa7) {
-        update_system_report(&USBQueue[pos]);
-      } else {
-        switch (output_direction) {
-          case OUTPUT_DIRECTION_USB:
-            update_keyboard_report(&USBQueue[pos]);
-            break;
-          case OUTPUT_DIRECTION_SERIAL:
-            update_serial_keyboard_report(&USBQueue[pos]);
-            break;
-          default:
-            break;
-        }
-
-      }
-      if ((USBQueue[pos].flags & USBQUEUE_RELEASED_MASK) == 0) {
-        // We only throttle keypresses. Key release doesn't slow us down -
-        // minimum duration is guaranteed by fact that key release goes after
-        // key press and keypress triggers cooldown.
-        cooldown_timer = config.delayLib[DELAYS_EVENT]; // Actual update
-                                                        // happened - reset
-                                                        // cooldown.
-        exp_keypress(
-            USBQueue[pos].keycode); // Let the downstream filter by keycode
-      }
-      USBQueue[pos].keycode = USBCODE_NOEVENT;
-      if (pos == USBQueue_readpos && pos != USBQueue_writepos) {
-        // Only if we're at first position. Previous cells may contain future
-        // actions otherwise! Also if not the last item - we don't want to
-        // overrun the buffer.
-        USBQueue_readpos = KEYCODE_BUFFER_NEXT(pos);
-      }
+    uint8_t keycode = USBQueue[0].event.keycode;
+    if (TEST_BIT(touched[keycode / 32], keycode % 32) ||
+        usb_usage_unsent(keycode)) {
       break;
     }
-  } while (pos != USBQueue_writepos);
+    SET_BIT(touched[keycode / 32], keycode % 32);
+    play_next_usbcode();
+  } while (!USBQUEUE_IS_EMPTY && USBQueue[0].event.sysTime <= now);
+  usb_release_reports();
+  report_tag.valid = false;
 }
 
 inline void pipeline_process(void) {
-  if (false) {
-    /*
-            playing non-game macro
-                if wait is blocking:
-                    if SCB has macro SC release:
-                        set that SCB pos to 0
-                        play after-wait part of macro to USBCB w/proper
-       timestamps
-    */
+  process_real_key();
+  run_macros();
+  if (cooldown_timer > 0) {
+    // Slow down! Delay 0 controls update rate.
+    // Counted in ticks - so setting delay0 to 10 will
+    // essentially makes it 100Hz keyboard with latency of 1kHz one.
+    cooldown_timer--;
   } else {
+    update_reports();
+  }
+  keymap_rebuild_slice();
+}
+
+/*
+ * Between ticks, as soon as scanner hands over scancodes. Drains the buffer -
+ * bounded, since pushed back scancodes stay put. Timers only move on ticks.
+ */
+inline void pipeline_process_events(void) {
+  for (uint8_t i = 0; i <= SCANCODE_BUFFER_END; i++) {
+    if (scancode_buffer_readpos == scancode_buffer_writepos) {
+      break;
+    }
     process_real_key();
   }
-  update_reports();
+  if (cooldown_timer == 0) {
+    update_reports();
+  }
 }
 
 inline bool pipeline_process_wakeup(void) {
@@ -362,8 +593,19 @@ void pipeline_init(void) {
   // Pipeline is worked on in main loop only, no point disabling IRQs to avoid
   // preemption.
   scan_reset();
-  USBQueue_readpos = 0;
-  USBQueue_writepos = 0;
+  USBQueue_count = 0;
   cooldown_timer = 0;
-  memset(USBQueue, USBCODE_NOEVENT, sizeof USBQueue);
+  // Scanner starts over and won't send releases for keys held now. Reports
+  // go out from update_reports, not from the config apply path.
+  memset(pressed_keys, 0, sizeof pressed_keys);
+  release_pending = true;
+  memset(perf.raw, 0, sizeof perf.raw);
+  memset(latency, 0, sizeof latency);
+  memset(macro_contexts, 0, sizeof macro_contexts);
+  perf.isrMinCycles = UINT32_MAX;
+  index_macros();
+  compile_layer_conditions();
+  // Layers may have changed under the cache.
+  keymap_layer = currentLayer;
+  keymap_valid = 0;
 }
\ No newline at end of file
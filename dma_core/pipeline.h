@@ -11,13 +11,10 @@
 #include "globals.h"
 #include <project.h>
 
-typedef union {
-  struct {
-    uint32_t sysTime;
-    uint8_t flags;
-    uint8_t keycode;
-  } __attribute__((packed));
-  uint8_t raw[6];
+typedef struct {
+  uint64_t sysTime; // microseconds, see timestamp_us()
+  uint8_t flags;
+  uint8_t keycode;
 } queuedScancode;
 
 #define USBCODE_TRANSPARENT 0
@@ -29,28 +26,124 @@ typedef union {
 #define USBQUEUE_RELEASED_MASK 0x80
 #define USBQUEUE_REAL_KEY_MASK 0x40
 
-#define KEYCODE_BUFFER_END 63
-#define KEYCODE_BUFFER_NEXT(X) ((X + 1) & KEYCODE_BUFFER_END)
-#define KEYCODE_BUFFER_PREV(X) ((X + KEYCODE_BUFFER_END) & KEYCODE_BUFFER_END)
-// ^^^ THIS MUST EQUAL 2^n-1!!! Used as bitmask.
+#define USBQUEUE_SIZE 64
 
 #define MACRO_NOT_FOUND UINT_FAST16_MAX
 #define MACRO_KEY_UPDOWN_RELEASE 0x02
 
-queuedScancode USBQueue[KEYCODE_BUFFER_END + 1];
-uint8_t USBQueue_readpos;
-uint8_t USBQueue_writepos;
-#define USBQUEUE_IS_EMPTY                                                      \
-  (USBQueue_readpos == USBQueue_writepos &&                                    \
-   USBQueue[USBQueue_readpos].keycode == USBCODE_NOEVENT)
+/*
+ * Macro index, rebuilt by pipeline_init. Key is keycode and on-key-up bit.
+ * Bitmap rejects keys without macros, sorted table finds the rest.
+ */
+#define MACRO_INDEX_KEY(FLAGS, KEYCODE)                                        \
+  (((KEYCODE) << 1) | (((FLAGS) & MACRO_TYPE_ONKEYUP) ? 1 : 0))
+#define MACRO_INDEX_SIZE 512
+typedef struct {
+  uint16_t key;
+  uint16_t ptr;
+} macro_index_t;
+uint32_t macro_bitmap[MACRO_INDEX_SIZE / 32];
+macro_index_t macro_index[MACRO_INDEX_SIZE];
+uint16_t macro_index_count;
+
+/*
+ * Pending USB events - binary min-heap by due time, so next due is always
+ * USBQueue[0]. Events due at the same time keep the order they were queued.
+ */
+typedef struct {
+  queuedScancode event;
+  uint16_t seq;
+  uint64_t detected; // timestamp_us() of the scancode, for latency stats
+  uint64_t queued;
+} usbqueue_entry_t;
+usbqueue_entry_t USBQueue[USBQUEUE_SIZE];
+uint8_t USBQueue_count;
+uint16_t USBQueue_seq;
+#define USBQUEUE_IS_EMPTY (USBQueue_count == 0)
+
+/*
+ * Macros being played. Each one resumes where it stopped once its wait is
+ * over and queues a few events at a time, leaving MACRO_QUEUE_RESERVE slots
+ * of USBQueue to real keys.
+ */
+#define MACRO_CONTEXTS 4
+#define MACRO_STEP_EVENTS 4
+#define MACRO_QUEUE_RESERVE 16
+typedef struct {
+  bool active;
+  bool releasing; // TypeOneKey waits to release `release`
+  uint8_t release;
+  uint16_t pc; // next command in config.macros
+  uint16_t end;
+  uint64_t wakeup; // timestamp_us() when next command is due
+  uint64_t detected; // trigger scancode, for latency stats
+  uint64_t picked;
+} macro_context_t;
+macro_context_t macro_contexts[MACRO_CONTEXTS];
+
+/*
+ * What is logically down. pressed_keys is usage and layer each scancode was
+ * pressed as, so release goes there whatever the layer is by then.
+ * pressed_usages is what was played to reports, macros included.
+ * pipeline_init only sets release_pending - next update_reports releases.
+ */
+typedef struct {
+  uint8_t usage;
+  uint8_t layer;
+} pressed_key_t;
+pressed_key_t pressed_keys[COMMONSENSE_MATRIX_SIZE];
+uint32_t pressed_usages[256 / 32];
+bool release_pending;
+void release_pressed_usages(void);
 
 uint8_t mods;
-uint8_t layerMods;
-#define LAYER_MODS_SHIFT 4
+uint8_t fnState; // bit N is Fn N+1 held
 uint8_t currentLayer;
 
+/*
+ * Layer for every Fn state, compiled from layerConditions by pipeline_init.
+ * LAYER_FN_KEYS in config.h is the condition width. Up to 4 a condition is
+ * a byte - Fn mask in the top nibble, layer in the bottom - and the table
+ * has 16 entries. Wider, a condition is a byte pair - Fn mask, then layer -
+ * so half as many fit, and the table covers all 256 Fn states. Either way
+ * it's one load per Fn press or release.
+ */
+#ifndef LAYER_FN_KEYS
+#define LAYER_FN_KEYS 4
+#endif
+#if LAYER_FN_KEYS > 8
+#error Fn state is a byte, 8 Fn keys max
+#endif
+#if LAYER_FN_KEYS > 4
+#define LAYER_TABLE_SIZE 256
+#define LAYER_CONDITION_BYTES 2
+#define LAYER_CONDITION_FN(C) ((C)[0])
+#define LAYER_CONDITION_LAYER(C) ((C)[1])
+#else
+#define LAYER_TABLE_SIZE 16
+#define LAYER_CONDITION_BYTES 1
+#define LAYER_CONDITION_FN(C) ((C)[0] >> 4)
+#define LAYER_CONDITION_LAYER(C) ((C)[0] & 0x0f)
+#endif
+#if NUM_LAYER_CONDITIONS % LAYER_CONDITION_BYTES
+#error Wide layer conditions come in pairs of bytes
+#endif
+#define LAYER_NO_CHANGE 0xff
+uint8_t layer_table[LAYER_TABLE_SIZE];
+
+/*
+ * currentLayer with transparent keys resolved. Layer switch restarts the
+ * rebuild, then KEYMAP_REBUILD_SLICE keys are done per pipeline_process.
+ * Keys at keymap_valid and above are resolved on the spot meanwhile.
+ */
+#define KEYMAP_REBUILD_SLICE 32
+uint8_t keymap[COMMONSENSE_MATRIX_SIZE];
+uint8_t keymap_layer;
+uint16_t keymap_valid;
+
 uint16_t cooldown_timer;
 
 void pipeline_init(void);
 void pipeline_process(void);
+void pipeline_process_events(void);
 bool pipeline_process_wakeup(void);
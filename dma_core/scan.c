@@ -15,37 +15,142 @@
 CY_ISR_PROTO(EoC_ISR);
 CY_ISR_PROTO(Result_ISR);
 
-uint8_t Buf0TD = CY_DMA_INVALID_TD;
-uint8_t Buf1TD = CY_DMA_INVALID_TD;
-uint8_t FinalBufTD[2];
+typedef struct {
+  void (*start)(void);
+  void (*set_resolution)(uint8);
+  void (*sleep)(void);
+  void (*wakeup)(void);
+  uint8 (*dma_init)(uint8, uint8, uint16, uint16);
+  uint32 result_reg;
+  uint8 td_termout;
+  uint8 columns;
+} adc_t;
+
+#define ADC_ENTRY(N)                                                           \
+  {ADC##N##_Start, ADC##N##_SetResolution, ADC##N##_Sleep, ADC##N##_Wakeup,    \
+   Buf##N##_DmaInitialize, (uint32)ADC##N##_ADC_SAR__WRK0,                     \
+   Buf##N##__TD_TERMOUT_EN, ADC##N##_COLUMNS}
+
+const adc_t adcs[NUM_ADCs] = {
+  ADC_ENTRY(0),
+#if NUM_ADCs > 1
+  ADC_ENTRY(1),
+#endif
+};
+uint8_t BufDma[NUM_ADCs];
+uint8_t BufTD[NUM_ADCs] = {[0 ... NUM_ADCs - 1] = CY_DMA_INVALID_TD};
+uint8_t FinalBufTD[RESULT_SLOTS * NUM_ADCs] = {
+    [0 ... RESULT_SLOTS * NUM_ADCs - 1] = CY_DMA_INVALID_TD};
 uint16_t BufMem[PTK_CHANNELS * NUM_ADCs];
 
 // We're only using low 8 bit of ADC output, but ADC gets us 16 and then 
-uint8_t Results[ADC_CHANNELS * 4 * NUM_ADCs];
+// One row per slot. DMA fills one slot while Result_ISR works on the other.
+uint8_t Results[RESULT_SLOTS][ADC_CHANNELS * 4 * NUM_ADCs];
+// Where each column's readout is within a Results row. Filled by map_columns.
+uint8_t column_offset[MATRIX_COLS];
+// Row that went into each slot - EoC_ISR records it when requesting the copy.
+uint8_t slot_row[RESULT_SLOTS];
+uint8_t eoc_slot, result_slot;
+// Free-running: rows requested from DMA by EoC_ISR, rows taken by Result_ISR.
+// Their difference is what Result_ISR has to catch up on - TERMOUTs can
+// coalesce, so interrupt count doesn't tell.
+uint16_t eoc_rows, result_rows;
 
-uint8_t reading_row, driving_row;
+uint8_t driving_row;
 bool scan_in_progress;
+// Passes are held back by idling this many rows - see sof_pass_end.
+uint8_t scan_idle_rows;
+bool sof_align;
+// USB frame phase in EoC rows, kept by the SOF ISR - see scan.h.
+uint16_t sof_rows; // eoc_rows at the last SOF
+uint16_t sof_period; // rows per frame, 0 until the second SOF
+uint16_t sof_deadline; // row the last pass of a frame should end on
 uint32_t matrix_status[MATRIX_ROWS];
 bool matrix_was_active;
 
-#define MAX_MATRIX_VALUE 0xffff
+// Readouts, only filled while matrix monitor is on. Full ADC resolution
+// unless filter is on - then it's what thresholds see.
 uint16_t matrix[COMMONSENSE_MATRIX_SIZE];
-uint16_t debouncing_mask;
-uint16_t debouncing_posedge;
-uint16_t debouncing_negedge;
+// Telemetry stream state: what host was sent last and where the stream is.
+uint16_t telemetry_sent[COMMONSENSE_MATRIX_SIZE];
+uint32_t telemetry_keyframe_rows;
+uint8_t telemetry_row;
+uint8_t telemetry_passes;
+uint8_t telemetry_ticks;
+
+/*
+ * Bit-sliced debouncer. Bit N of every word is column N of the row.
+ * Each key has a DEBOUNCING_COUNTER_BITS-wide vertical counter of samples
+ * left before the current run of identical samples is accepted.
+ * Counter is reloaded on every change of the sample, key fires when it hits 0.
+ */
+typedef struct {
+  uint32_t last_sample;
+  uint32_t counter[DEBOUNCING_COUNTER_BITS];
+} debouncer_row_t;
+debouncer_row_t debouncer[MATRIX_ROWS];
+#if (1 << DEBOUNCING_COUNTER_BITS) < MAX_DEBOUNCING_BUFFER_SIZE
+#error DEBOUNCING_COUNTER_BITS too small for MAX_DEBOUNCING_BUFFER_SIZE
+#endif
+uint32_t debouncing_reload[DEBOUNCING_COUNTER_BITS];
+
+// Per-key resting level for adaptive thresholds. Only valid for keys with
+// their bit set in baseline_seeded - a row per word, like matrix_status.
+uint16_t baseline[COMMONSENSE_MATRIX_SIZE];
+uint32_t baseline_seeded[MATRIX_ROWS];
+bool adaptive_thresholds;
+
+/*
+ * Eager press mode. Lockout is another vertical counter - passes left
+ * before key is allowed to release. "fresh" are keys pressed last pass.
+ */
+typedef struct {
+  uint32_t fresh;
+  uint32_t lockout[LOCKOUT_COUNTER_BITS];
+} eager_row_t;
+eager_row_t eager[MATRIX_ROWS];
+uint32_t eager_lockout_reload[LOCKOUT_COUNTER_BITS];
+bool eager_press;
+
+// Per-key IIR filtered levels, same fixed point as baseline.
+uint16_t filtered[COMMONSENSE_MATRIX_SIZE];
+uint8_t filter_depth;
+uint32_t filter_seeded_rows;
 uint8_t scancodes_while_output_disabled = 0;
 
+// Accumulators for the current second of perf counters.
+uint32_t perf_passes;
+uint32_t perf_isr_cycles;
+uint32_t perf_isr_count;
+uint32_t perf_phase_sum; // rows
+uint32_t perf_phase_count;
+uint16_t perf_phase_max;
+uint16_t perf_ms;
+
+/*
+ * Every ADC gets a slice of ADC_CHANNELS readouts in a Results row, with
+ * 16-bit samples interleaved with grounded channel - hence the 4 byte step.
+ * Columns are counted down: first readout of ADC0 is the last column.
+ */
+static void map_columns(void) {
+  uint8_t col = MATRIX_COLS;
+  for (uint8_t adc = 0; adc < NUM_ADCs; adc++) {
+    for (uint8_t pos = 0; pos < adcs[adc].columns; pos++) {
+      column_offset[--col] = (adc * ADC_CHANNELS + pos) * 4;
+    }
+  }
+}
+
 void init_sensor(uint8_t debouncing_period) {
   // Init DMA, each burst requires a request
-  Buf0_DmaInitialize(sizeof BufMem[0], 1, (uint16)(HI16(CYDEV_PERIPH_BASE)),
-                     (uint16)(HI16(CYDEV_SRAM_BASE)));
-#if NUM_ADCs > 1
-  Buf1_DmaInitialize(sizeof BufMem[0], 1, (uint16)(HI16(CYDEV_PERIPH_BASE)),
-                     (uint16)(HI16(CYDEV_SRAM_BASE)));
-#endif
+  for (uint8_t adc = 0; adc < NUM_ADCs; adc++) {
+    BufDma[adc] = adcs[adc].dma_init(sizeof BufMem[0], 1,
+                                     (uint16)(HI16(CYDEV_PERIPH_BASE)),
+                                     (uint16)(HI16(CYDEV_SRAM_BASE)));
+  }
   // 1 request per ADC, get the whole ADC buffer (skip grounded channels which
   // are at the end).
-  FinalBuf_DmaInitialize(sizeof Results / NUM_ADCs, NUM_ADCs,
+  FinalBuf_DmaInitialize(sizeof Results[0] / NUM_ADCs, NUM_ADCs,
                          (uint16)(HI16(CYDEV_SRAM_BASE)),
                          (uint16)(HI16(CYDEV_SRAM_BASE)));
   uint8 enableInterrupts = CyEnterCriticalSection();
@@ -55,31 +160,50 @@ void init_sensor(uint8_t debouncing_period) {
   (*(reg8 *)PTK_ChannelCounter__CONTROL_AUX_CTL_REG) |=
       (uint8)0x20u; // Init count7
   CyExitCriticalSection(enableInterrupts);
-  ADC0_Start();
-  ADC0_SetResolution(config.adcBits);
-#if NUM_ADCs > 1
-  ADC1_Start();
-  ADC1_SetResolution(config.adcBits);
-#endif
+  for (uint8_t adc = 0; adc < NUM_ADCs; adc++) {
+    adcs[adc].start();
+    adcs[adc].set_resolution(config.adcBits);
+  }
+  map_columns();
   ChargeDelay_Start();
   ChargeDelay_WritePeriod(config.chargeDelay);
   DischargeDelay_Start();
   DischargeDelay_WritePeriod(config.dischargeDelay);
-  debouncing_mask = MAX_MATRIX_VALUE << debouncing_period;
-  debouncing_negedge = 1 << (debouncing_period - 1);
-  debouncing_posedge = ~debouncing_negedge | debouncing_mask;
-  debouncing_negedge |= debouncing_mask;
+  // Key fires after (debouncing_period - 1) identical samples, but no sooner
+  // than the sample it changed on - so 1 and 2 both mean "no debouncing".
+  // The old shift register debouncer reported inverted key state for 1,
+  // so no working config depends on it. tests/debounce_test.c checks both.
+  uint8_t reload = (debouncing_period > 1) ? debouncing_period - 1 : 1;
+  for (uint8_t i = 0; i < DEBOUNCING_COUNTER_BITS; i++) {
+    debouncing_reload[i] = (reload & (1 << i)) ? 0xffffffff : 0;
+  }
+  adaptive_thresholds = TEST_BIT(config.capsenseFlags, CSF_ADAPTIVE);
+  // Baselines survive scan_reset (matrix monitor toggles it), but not this.
+  memset(baseline, 0, sizeof(baseline));
+  memset(baseline_seeded, 0, sizeof(baseline_seeded));
+  filter_depth = config.filterDepth;
+  filter_seeded_rows = 0;
+  eager_press = TEST_BIT(config.capsenseFlags, CSF_EAGER);
+  for (uint8_t i = 0; i < LOCKOUT_COUNTER_BITS; i++) {
+    eager_lockout_reload[i] = (config.eagerLockout & (1 << i)) ? 0xffffffff : 0;
+  }
+  eager_glitches = 0;
+  sof_align = TEST_BIT(config.capsenseFlags, CSF_SOF_ALIGN);
   scan_reset();
 }
 
 void sensor_nap(void) {
   ChargeDelay_Sleep();
   DischargeDelay_Sleep();
-  ADC0_Sleep();
+  for (uint8_t adc = 0; adc < NUM_ADCs; adc++) {
+    adcs[adc].sleep();
+  }
 }
 
 void sensor_wake(void) {
-  ADC0_Wakeup();
+  for (uint8_t adc = 0; adc < NUM_ADCs; adc++) {
+    adcs[adc].wakeup();
+  }
   DischargeDelay_Wakeup();
   ChargeDelay_Wakeup();
 }
@@ -98,53 +222,57 @@ void BufferSetup(uint8 chan, uint8 *td, uint8 channel_config,
 }
 
 void ResultBufferSetup(void) {
+  uint8_t td_count = RESULT_SLOTS * NUM_ADCs;
+  CyDmaChDisable(FinalBuf_DmaHandle);
   CyDmaClearPendingDrq(FinalBuf_DmaHandle);
-  FinalBufTD[0] = CyDmaTdAllocate();
-#if NUM_ADCs == 1
-  CyDmaTdSetConfiguration(
-      FinalBufTD[0], (uint16)(sizeof Results), FinalBufTD[0],
-      CY_DMA_TD_INC_SRC_ADR | CY_DMA_TD_INC_DST_ADR | FinalBuf__TD_TERMOUT_EN);
-  CyDmaTdSetAddress(FinalBufTD[0],
-                    LO16((uint32)&BufMem[ADC_BUF_INITIAL_OFFSET]),
-                    LO16((uint32)&Results));
-#elif NUM_ADCs == 2
-  FinalBufTD[1] = CyDmaTdAllocate();
-  // transferCount is actually bytes, not transactions.
-  CyDmaTdSetConfiguration(
-      FinalBufTD[0], (uint16)(sizeof Results / NUM_ADCs), FinalBufTD[1],
-      CY_DMA_TD_INC_SRC_ADR | CY_DMA_TD_INC_DST_ADR | CY_DMA_TD_AUTO_EXEC_NEXT);
-  CyDmaTdSetAddress(FinalBufTD[0],
-                    LO16((uint32)&BufMem[ADC_BUF_INITIAL_OFFSET]),
-                    LO16((uint32)&Results));
-  CyDmaTdSetConfiguration(
-      FinalBufTD[1], (uint16)(sizeof Results / NUM_ADCs), FinalBufTD[0],
-      CY_DMA_TD_INC_SRC_ADR | CY_DMA_TD_INC_DST_ADR | FinalBuf__TD_TERMOUT_EN);
-  CyDmaTdSetAddress(
-      FinalBufTD[1],
-      LO16((uint32)&BufMem[PTK_CHANNELS + ADC_BUF_INITIAL_OFFSET]),
-      LO16((uint32)&Results[ADC_CHANNELS * 2]));
-#else
-#error only 1 and 2 ADCs are supported
-#endif
+  for (uint8_t td = 0; td < td_count; td++) {
+    if (FinalBufTD[td] == CY_DMA_INVALID_TD)
+      FinalBufTD[td] = CyDmaTdAllocate();
+  }
+  // Each EoC request moves one row: NUM_ADCs TDs chained by AUTO_EXEC_NEXT.
+  // The last one triggers Result_ISR.
+  for (uint8_t slot = 0; slot < RESULT_SLOTS; slot++) {
+    for (uint8_t adc = 0; adc < NUM_ADCs; adc++) {
+      uint8_t td = slot * NUM_ADCs + adc;
+      uint8_t td_config = CY_DMA_TD_INC_SRC_ADR | CY_DMA_TD_INC_DST_ADR;
+      if (adc != NUM_ADCs - 1) { // not "<" - that is "< 0" with one ADC
+        td_config |= CY_DMA_TD_AUTO_EXEC_NEXT;
+      } else {
+        td_config |= FinalBuf__TD_TERMOUT_EN;
+      }
+      // transferCount is actually bytes, not transactions.
+      CyDmaTdSetConfiguration(FinalBufTD[td],
+                              (uint16)(sizeof Results[0] / NUM_ADCs),
+                              FinalBufTD[(td + 1) % td_count], td_config);
+      CyDmaTdSetAddress(
+          FinalBufTD[td],
+          LO16((uint32)&BufMem[adc * PTK_CHANNELS + ADC_BUF_INITIAL_OFFSET]),
+          LO16((uint32)&Results[slot][adc * sizeof Results[0] / NUM_ADCs]));
+    }
+  }
+  eoc_slot = 0;
+  result_slot = 0;
+  eoc_rows = 0;
+  result_rows = 0;
   CyDmaChSetInitialTd(FinalBuf_DmaHandle, FinalBufTD[0]);
   CyDmaChEnable(FinalBuf_DmaHandle, 1);
 }
 
 void enable_sensor(void) {
-  BufferSetup(Buf0_DmaHandle, &Buf0TD, Buf0__TD_TERMOUT_EN,
-              (uint32)ADC0_ADC_SAR__WRK0, (uint32)BufMem);
-#if NUM_ADCs > 1
-  BufferSetup(Buf1_DmaHandle, &Buf1TD, Buf1__TD_TERMOUT_EN,
-              (uint32)ADC1_ADC_SAR__WRK0, ADC_BUFFER_BYTESIZE + (uint32)BufMem);
-#endif
+  for (uint8_t adc = 0; adc < NUM_ADCs; adc++) {
+    BufferSetup(BufDma[adc], &BufTD[adc], adcs[adc].td_termout,
+                adcs[adc].result_reg, (uint32)&BufMem[adc * PTK_CHANNELS]);
+  }
   ResultBufferSetup();
   (*(reg8 *)PTK_CtrlReg__CONTROL_REG) =
       (uint8)0b11u; // enable counter's clock, generate counter load pulse
-  // It is important that ResultIRQ priority is less (=is higher)
-  // so we don't start fetching next buffer before we are done with the current
-  // one.
   ResultIRQ_StartEx(Result_ISR);
   EoCIRQ_StartEx(EoC_ISR);
+  // EoC must win over Result_ISR - next row has to be driven on time even if
+  // processing of the previous one isn't done. That's safe since DMA fetches
+  // into the other half of the slot ring.
+  ResultIRQ_SetPriority(EoCIRQ__INTC_PRIOR_NUM);
+  EoCIRQ_SetPriority(ResultIRQ__INTC_PRIOR_NUM);
 }
 
 static inline void Drive(uint8 drv) {
@@ -158,6 +286,11 @@ static inline void Drive(uint8 drv) {
   DriveReg0_Write(1 << drv);
 }
 
+static inline void DriveIdle(void) {
+  // Same start pulse, no row - Result_ISR skips rows past the matrix.
+  DriveReg0_Write(0);
+}
+
 static inline void append_scancode(uint8_t flags, uint8_t scancode) {
   if (0 == TEST_BIT(status_register, C2DEVSTATUS_OUTPUT_ENABLED)) {
     if (scancodes_while_output_disabled <= SCANNER_INSANITY_THRESHOLD) {
@@ -174,10 +307,72 @@ static inline void append_scancode(uint8_t flags, uint8_t scancode) {
   }
 #endif
   scancode_buffer_writepos = SCANCODE_BUFFER_NEXT(scancode_buffer_writepos);
+  // Reader leaves consumed cells as flags 0 + NOKEY.
+  if (scancode_buffer[scancode_buffer_writepos].scancode != COMMONSENSE_NOKEY
+      || scancode_buffer[scancode_buffer_writepos].flags != 0) {
+    perf.scancodeOverwrites++;
+  }
+  uint8_t used = (scancode_buffer_writepos - scancode_buffer_readpos) &
+                 SCANCODE_BUFFER_END;
+  if (used > perf.scancodeHighWater) {
+    perf.scancodeHighWater = used;
+  }
+  scancode_buffer[scancode_buffer_writepos].time = timestamp_us();
   scancode_buffer[scancode_buffer_writepos].flags = flags;
   scancode_buffer[scancode_buffer_writepos].scancode = scancode;
+  pipeline_pending = true;
+}
+
+
+/*
+ * USBFS SOF interrupt. EoC fires for idle rows too, so rows between two SOFs
+ * is the frame length. Everything EoC needs is worked out here, once a frame.
+ */
+void USB_SOF_ISR_EntryCallback(void) {
+  uint8_t enableInterrupts = CyEnterCriticalSection();
+  uint16_t rows = eoc_rows;
+  uint16_t period = rows - sof_rows;
+  // A row takes over 1us - more rows than that is scan restarting, not phase.
+  sof_period = (period <= USB_FRAME_US) ? period : 0;
+  sof_rows = rows;
+  sof_deadline =
+      rows + sof_period - sof_period * SOF_ALIGN_GUARD_US / USB_FRAME_US;
+  CyExitCriticalSection(enableInterrupts);
 }
 
+/*
+ * End of a pass. Measures how many rows before the host poll the last pass
+ * of the frame ended - that's how stale the report it gets is. With
+ * CSF_SOF_ALIGN, before the last pass of the frame returns rows to idle so
+ * that this pass ends right on target. Costs at most one pass worth of idle
+ * per frame.
+ */
+static inline uint8_t sof_pass_end(void) {
+  int16_t to_target = (int16_t)(sof_deadline - eoc_rows);
+  int16_t period = sof_period;
+  if (period == 0 || to_target < -(SOF_STALE_FRAMES - 1) * period) {
+    return 0;
+  }
+  while (to_target < 0) {
+    // Past the target, aim at the next frame.
+    to_target += period;
+  }
+  if (to_target < MATRIX_ROWS) {
+    // Last pass before the poll.
+    perf_phase_sum += to_target;
+    perf_phase_count++;
+    if (to_target > perf_phase_max) {
+      perf_phase_max = to_target;
+    }
+    // Too late for this frame, aim at the next one.
+    to_target += period;
+  }
+  if (!sof_align || to_target >= 2 * MATRIX_ROWS) {
+    return 0;
+  }
+  // Next pass is the last one - idle so that it ends on target.
+  return to_target - MATRIX_ROWS;
+}
 
 CY_ISR(EoC_ISR) {
 #ifdef DEBUG_INTERRUPTS
@@ -190,9 +385,11 @@ CY_ISR(EoC_ISR) {
   return;
 // The rest of the code is dead in 100kHz mode.
 #endif
+  slot_row[eoc_slot] = driving_row;
+  eoc_slot = (eoc_slot + 1 == RESULT_SLOTS) ? 0 : eoc_slot + 1;
+  eoc_rows++;
   CyDmaChSetRequest(FinalBuf_DmaHandle, CY_DMA_CPU_REQ);
   uint8_t enableInterrupts = CyEnterCriticalSection();
-  reading_row = driving_row;
   if (0 == driving_row) {
     // End of the scan pass. Loop if full throttle, otherwise stop.
     if (power_state != DEVSTATE_FULL_THROTTLE
@@ -201,6 +398,13 @@ CY_ISR(EoC_ISR) {
       goto EoC_final; // Important - otherwise interrupts are left disabled!
     }
     driving_row = MATRIX_ROWS;
+    perf_passes++;
+    scan_idle_rows = sof_pass_end();
+  }
+  if (scan_idle_rows > 0) {
+    scan_idle_rows--;
+    DriveIdle();
+    goto EoC_final;
   }
   driving_row--;
   // Drive row.
@@ -212,59 +416,178 @@ EoC_final:
   CyExitCriticalSection(enableInterrupts);
 }
 
-CY_ISR(Result_ISR) {
-#ifdef DEBUG_INTERRUPTS
-  PIN_DEBUG(1, 2)
+/*
+ * Feeds one row of samples (1 = pressed) through vertical counters.
+ * Returns mask of keys whose current sample run has just become stable.
+ */
+static inline uint32_t debounce_row(debouncer_row_t *d, uint32_t samples) {
+  uint32_t changed = samples ^ d->last_sample;
+  uint32_t active = 0;
+  d->last_sample = samples;
+  for (uint8_t i = 0; i < DEBOUNCING_COUNTER_BITS; i++) {
+    d->counter[i] = (d->counter[i] & ~changed) | (debouncing_reload[i] & changed);
+    active |= d->counter[i];
+  }
+  // Decrement non-zero counters: ripple borrow through the bit-planes.
+  uint32_t borrow = active;
+  uint32_t remaining = 0;
+  for (uint8_t i = 0; i < DEBOUNCING_COUNTER_BITS; i++) {
+    uint32_t bit = d->counter[i];
+    d->counter[i] = bit ^ borrow;
+    borrow &= ~bit;
+    remaining |= d->counter[i];
+  }
+  return active & ~remaining;
+}
+
+/*
+ * Eager press: any pressed sample is reported right away and locks the key
+ * pressed for eagerLockout passes. Release still needs a debounced run of
+ * released samples - that's what debouncer counters at zero mean.
+ * Returns mask of keys changing state.
+ */
+static inline uint32_t eager_row(uint8_t row, uint32_t samples,
+                                 uint32_t row_status) {
+  eager_row_t *e = &eager[row];
+  uint32_t glitches = e->fresh & ~samples;
+  if (glitches) {
+    eager_glitches += __builtin_popcount(glitches);
+  }
+  uint32_t locked = 0;
+  uint32_t debouncing = 0;
+  for (uint8_t i = 0; i < DEBOUNCING_COUNTER_BITS; i++) {
+    debouncing |= debouncer[row].counter[i];
+  }
+  uint32_t presses = samples & ~row_status;
+  // Count lockout down, then load it for new presses.
+  uint32_t borrow = 0;
+  for (uint8_t i = 0; i < LOCKOUT_COUNTER_BITS; i++) {
+    borrow |= e->lockout[i];
+  }
+  for (uint8_t i = 0; i < LOCKOUT_COUNTER_BITS; i++) {
+    uint32_t bit = e->lockout[i];
+    e->lockout[i] = ((bit ^ borrow) & ~presses) |
+                    (eager_lockout_reload[i] & presses);
+    borrow &= ~bit;
+    locked |= e->lockout[i];
+  }
+  e->fresh = presses;
+  return presses | (~samples & row_status & ~debouncing & ~locked);
+}
+
+/*
+ * Smooths the key level over passes. First pass after init just loads
+ * the filter - otherwise it would ramp from 0 and look like a keypress.
+ */
+static inline uint8_t filter_level(uint8_t keyIndex, uint8_t level,
+                                   bool seed) {
+  if (seed) {
+    filtered[keyIndex] = level << BASELINE_FRACTION_BITS;
+  } else {
+    filtered[keyIndex] +=
+        ((int32_t)(level << BASELINE_FRACTION_BITS) - filtered[keyIndex]) >>
+        filter_depth;
+  }
+  return (filtered[keyIndex] + (1 << (BASELINE_FRACTION_BITS - 1))) >>
+         BASELINE_FRACTION_BITS;
+}
+
+/*
+ * Compares level to key baseline, press or release offset depending on
+ * current key state - that's the hysteresis. Baseline only follows released
+ * keys, so a slow press can't drag it along.
+ * Until the key has a baseline its static threshold decides, and only a
+ * sample on the released side of it seeds the baseline - otherwise a key
+ * held at power up would take its pressed level as resting one.
+ */
+static inline bool adaptive_sample(uint8_t row, uint32_t col_bit,
+                                   uint8_t keyIndex, uint8_t level,
+                                   bool pressed) {
+  if (!(baseline_seeded[row] & col_bit)) {
+#if NORMALLY_LOW == 1
+    bool result = level > config.thresholds[keyIndex];
+#else
+    bool result = level < config.thresholds[keyIndex];
 #endif
-#ifdef COMMONSENSE_100KHZ_MODE
-  return;
-// The rest of the code is dead in 100kHz mode.
+    if (!result) {
+      baseline[keyIndex] = level << BASELINE_FRACTION_BITS;
+      baseline_seeded[row] |= col_bit;
+    }
+    return result;
+  }
+  int16_t base = baseline[keyIndex] >> BASELINE_FRACTION_BITS;
+  int16_t offset = pressed ? config.releaseOffset : config.pressOffset;
+#if NORMALLY_LOW == 1
+  bool result = level > base + offset;
+#else
+  bool result = level < base - offset;
 #endif
-  int8_t adc_buffer_pos = -4;
+  if (!pressed && !result) {
+    baseline[keyIndex] +=
+        ((int32_t)(level << BASELINE_FRACTION_BITS) - baseline[keyIndex]) >>
+        BASELINE_IIR_SHIFT;
+  }
+  return result;
+}
+
+// Thresholds, debounces and reports one row of readouts.
+static inline void process_row(uint8_t row, uint8_t *results) {
   // keyIndex - same speed as static global on -O3, faster in -Os
-  // having uint16_t* for cell is slower than directly using matrix[keyIndex].
-  uint8_t keyIndex = (reading_row + 1) * MATRIX_COLS;
+  uint8_t keyIndex = (row + 1) * MATRIX_COLS;
+  uint8_t level;
+  bool seed_filter = !TEST_BIT(filter_seeded_rows, row);
+  SET_BIT(filter_seeded_rows, row);
+  bool monitor = TEST_BIT(status_register, C2DEVSTATUS_MATRIX_MONITOR);
   // caching row status is faster than direct array access
-  uint32_t row_status = matrix_status[reading_row];
-#if PROFILE_SCAN_PROCESSING == 1
-  CyPins_SetPin(ExpHdr_1);
-#endif
-  for (int8_t curCol = ADC_CHANNELS * NUM_ADCs - 1; curCol >= 0; curCol--) {
-    adc_buffer_pos += 4;
-    // TEST_BIT is faster than bool inited outside of the loop.
-    if (TEST_BIT(status_register, C2DEVSTATUS_MATRIX_MONITOR)) {
-      // When monitoring matrix we're interested in raw feed.
-      matrix[--keyIndex] = Results[adc_buffer_pos];
-      continue;
+  uint32_t row_status = matrix_status[row];
+  uint32_t samples = 0;
+  for (int8_t curCol = MATRIX_COLS - 1; curCol >= 0; curCol--) {
+    uint8_t offset = column_offset[curCol];
+    level = results[offset];
+    if (filter_depth) {
+      level = filter_level(keyIndex - 1, level, seed_filter);
+    }
+    if (monitor) {
+      matrix[keyIndex - 1] =
+          filter_depth ? level : results[offset] | (results[offset + 1] << 8);
+    }
+    bool pressed;
+    if (adaptive_thresholds) {
+      pressed = adaptive_sample(row, 1 << curCol, --keyIndex, level,
+                                row_status & (1 << curCol));
+    } else {
 #if NORMALLY_LOW == 1
-    } else if (Results[adc_buffer_pos] > config.thresholds[--keyIndex]) {
+      pressed = level > config.thresholds[--keyIndex];
 #else
-    } else if (Results[adc_buffer_pos] < config.thresholds[--keyIndex]) {
+      pressed = level < config.thresholds[--keyIndex];
 #endif
+    }
+    if (pressed) {
       // Key pressed
-      matrix[keyIndex] = ((matrix[keyIndex] << 1) | debouncing_mask) + 1;
+      samples |= (1 << curCol);
 #if DEBUG_SHOW_MATRIX_EVENTS == 1
       PIN_DEBUG(4, 1);
 #endif
-    } else {
-      matrix[keyIndex] = ((matrix[keyIndex] << 1) | debouncing_mask);
-    }
-
-    if (matrix[keyIndex] == debouncing_posedge &&
-        (row_status & (1 << curCol)) == 0) {
-      row_status |= (1 << curCol);
-      append_scancode(0, keyIndex);
-    } else if (matrix[keyIndex] == debouncing_negedge &&
-        (row_status & (1 << curCol))) {
-      row_status &= ~(1 << curCol);
-      append_scancode(KEY_UP_MASK, keyIndex);
     }
   }
-#if PROFILE_SCAN_PROCESSING == 1
-  CyPins_ClearPin(ExpHdr_1);
-#endif
-  matrix_status[reading_row] = row_status;
-  if (reading_row == 0) {
+  uint32_t settled = debounce_row(&debouncer[row], samples);
+  uint32_t events;
+  if (eager_press) {
+    events = eager_row(row, samples, row_status);
+  } else {
+    // Only report keys whose settled state differs from what we reported.
+    events = settled & (samples ^ row_status);
+  }
+  row_status ^= events;
+  // Highest column first - same order keys were always reported in.
+  while (events) {
+    uint8_t curCol = 31 - __builtin_clz(events);
+    events &= ~(1 << curCol);
+    append_scancode((row_status & (1 << curCol)) ? 0 : KEY_UP_MASK,
+                    keyIndex + curCol);
+  }
+  matrix_status[row] = row_status;
+  if (row == 0) {
     // End of matrix reading cycle.
     for (uint8_t i = MATRIX_ROWS - 1; i > 0; --i) {
       row_status |= matrix_status[i];
@@ -279,6 +602,46 @@ CY_ISR(Result_ISR) {
   }
 }
 
+CY_ISR(Result_ISR) {
+  uint32_t started = CySysTickGetValue();
+#ifdef DEBUG_INTERRUPTS
+  PIN_DEBUG(1, 2)
+#endif
+#ifdef COMMONSENSE_100KHZ_MODE
+  return;
+// The rest of the code is dead in 100kHz mode.
+#endif
+#if PROFILE_SCAN_PROCESSING == 1
+  CyPins_SetPin(ExpHdr_1);
+#endif
+  // EoC_ISR preempts this one, so re-read eoc_rows after every row.
+  for (uint16_t behind = eoc_rows - result_rows; behind > 0;
+       behind = eoc_rows - result_rows) {
+    if (behind == 1 && CyDmaChGetRequest(FinalBuf_DmaHandle) != 0) {
+      // Row is still being copied - its TERMOUT will bring us back.
+      break;
+    }
+    // A row the ring has already lapped is overwritten - skip it.
+    if (behind <= RESULT_SLOTS && slot_row[result_slot] < MATRIX_ROWS) {
+      process_row(slot_row[result_slot], Results[result_slot]);
+    }
+    result_slot = (result_slot + 1 == RESULT_SLOTS) ? 0 : result_slot + 1;
+    result_rows++;
+  }
+#if PROFILE_SCAN_PROCESSING == 1
+  CyPins_ClearPin(ExpHdr_1);
+#endif
+  uint32_t cycles = cycles_since(started);
+  perf_isr_cycles += cycles;
+  perf_isr_count++;
+  if (cycles < perf.isrMinCycles) {
+    perf.isrMinCycles = cycles;
+  }
+  if (cycles > perf.isrMaxCycles) {
+    perf.isrMaxCycles = cycles;
+  }
+}
+
 void scan_start(void) {
   if (scan_in_progress) {
     return;
@@ -288,24 +651,32 @@ void scan_start(void) {
   SET_BIT(status_register, C2DEVSTATUS_SCAN_ENABLED);
   CLEAR_BIT(status_register, C2DEVSTATUS_OUTPUT_ENABLED);
   driving_row = MATRIX_ROWS - 1; // Zero-based! Adjust!
+  scan_idle_rows = 0;
   Drive(driving_row);
   scan_in_progress = true;
 }
 
 void scan_reset(void) {
   uint8_t enableInterrupts = CyEnterCriticalSection();
-  for (uint8_t i = 0; i < COMMONSENSE_MATRIX_SIZE; i++) {
-#if NORMALLY_LOW == 1
-    matrix[i] = 0;
-#else
-    matrix[i] = MAX_MATRIX_VALUE;
-#endif
+  // Pretend every key sat in its initial state forever - nothing pending.
+  memset(debouncer, 0, sizeof(debouncer));
+#if NORMALLY_LOW == 0
+  for (uint8_t i = 0; i < MATRIX_ROWS; i++) {
+    debouncer[i].last_sample = 0xffffffff;
   }
+#endif
+  memset(matrix, 0, sizeof(matrix));
+  // Host starts from scratch - every row goes out in full first.
+  telemetry_keyframe_rows = 0xffffffff;
+  telemetry_row = 0;
+  telemetry_passes = 0;
+  telemetry_ticks = 0;
   for(uint8_t i = 0; i <= SCANCODE_BUFFER_END; i++) {
     scancode_buffer[i].flags = 0;
     scancode_buffer[i].scancode = COMMONSENSE_NOKEY;
   }
   memset(matrix_status, 0, sizeof(matrix_status));
+  memset(eager, 0, sizeof(eager));
   scancode_buffer_readpos = 0;
   scancode_buffer_writepos = 0;
   CyExitCriticalSection(enableInterrupts);
@@ -332,7 +703,32 @@ void scan_wake(void) {
   sensor_wake();
 }
 
-inline void scan_tick() {};
+inline void scan_tick() {
+  if (++perf_ms < 1000) {
+    return;
+  }
+  uint8_t enableInterrupts = CyEnterCriticalSection();
+  perf.passesPerSecond = perf_passes;
+  perf.isrAvgCycles = perf_isr_count ? perf_isr_cycles / perf_isr_count : 0;
+  if (sof_period > 0) {
+    // Rows to us at the current frame length.
+    perf.sofPhaseAvg = perf_phase_count ? perf_phase_sum * USB_FRAME_US /
+                                              sof_period / perf_phase_count
+                                        : 0;
+    uint32_t phase_max = (uint32_t)perf_phase_max * USB_FRAME_US / sof_period;
+    if (phase_max > perf.sofPhaseMax) {
+      perf.sofPhaseMax = phase_max;
+    }
+  }
+  perf_passes = 0;
+  perf_isr_cycles = 0;
+  perf_isr_count = 0;
+  perf_phase_sum = 0;
+  perf_phase_count = 0;
+  perf_phase_max = 0;
+  CyExitCriticalSection(enableInterrupts);
+  perf_ms = 0;
+}
 
 void scan_sanity_check(void) {
   --sanity_check_timer;
@@ -340,22 +736,101 @@ void scan_sanity_check(void) {
     // Keyboard is insane. Disable it.
     status_register &= (1 << C2DEVSTATUS_SETUP_MODE); // Keep setup mode.
     SET_BIT(status_register, C2DEVSTATUS_INSANE);
-    xprintf("Scan module has gone insane and had to be shot!");
+    LOG(LOG_SCANNER_INSANE);
     sanity_check_timer = 0;
   } else if (0 == sanity_check_timer) {
     SET_BIT(status_register, C2DEVSTATUS_OUTPUT_ENABLED);
   }
 }
 
+/*
+ * Packs one row into telemetry record at out. Deltas if all of them fit in a
+ * nibble, absolute values otherwise or when keyframe is due. Returns record
+ * size, 0 if it doesn't fit in room.
+ */
+static uint8_t pack_telemetry_row(uint8_t row, uint8_t *out, uint8_t room) {
+  uint16_t *sent = &telemetry_sent[row * MATRIX_COLS];
+  uint16_t now[MATRIX_COLS];
+  // Result_ISR keeps writing - work from a snapshot.
+  memcpy(now, &matrix[row * MATRIX_COLS], sizeof(now));
+  bool absolute = TEST_BIT(telemetry_keyframe_rows, row);
+  for (uint8_t i = 0; i < MATRIX_COLS && !absolute; i++) {
+    int16_t delta = now[i] - sent[i];
+    absolute = (delta < -8 || delta > 7);
+  }
+  uint8_t size = 1 + (absolute ? MATRIX_TELEMETRY_ABSOLUTE_BYTES(MATRIX_COLS)
+                               : MATRIX_TELEMETRY_DELTA_BYTES(MATRIX_COLS));
+  if (size > room) {
+    return 0;
+  }
+  memset(out, 0, size);
+  *out++ = row | (absolute ? MATRIX_TELEMETRY_ABSOLUTE : 0);
+  for (uint8_t i = 0; i < MATRIX_COLS; i++) {
+    if (absolute) {
+      uint16_t value = now[i] & MATRIX_TELEMETRY_MAX;
+      uint8_t *pair = &out[i / 2 * 3];
+      if (i & 1) {
+        pair[1] |= value << 4;
+        pair[2] = value >> 4;
+      } else {
+        pair[0] = value;
+        pair[1] = value >> 8;
+      }
+      sent[i] = value;
+    } else {
+      out[i / 2] |= ((now[i] - sent[i]) & 0x0f) << ((i & 1) * 4);
+      sent[i] = now[i];
+    }
+  }
+  CLEAR_BIT(telemetry_keyframe_rows, row);
+  return size;
+}
+
+/*
+ * Streams readouts to the host, as many rows per packet as fit. Never waits
+ * for USB - if previous packet is still there, this tick is skipped and host
+ * gets fresher values next time.
+ */
 void report_matrix_readouts(void) {
-  uint8_t idx = 0;
-  for (uint8 i = 0; i < MATRIX_ROWS; i++) {
-    outbox.response_type = C2RESPONSE_MATRIX_ROW;
-    outbox.payload[0] = i;
+  if (!usb_c2_idle()) {
+    return;
+  }
+  memset(outbox.raw, 0, sizeof(outbox.raw));
+  if (adaptive_thresholds &&
+      (++telemetry_ticks & MATRIX_TELEMETRY_BASELINE_MASK) == 0) {
+    // Baselines drift slowly - a row once in a while is plenty.
+    uint8_t row = (telemetry_ticks / (MATRIX_TELEMETRY_BASELINE_MASK + 1)) %
+                  MATRIX_ROWS;
+    uint8_t idx = row * MATRIX_COLS;
+    outbox.response_type = C2RESPONSE_BASELINE_ROW;
+    outbox.payload[0] = row;
     outbox.payload[1] = MATRIX_COLS;
     for (uint8_t j = 0; j < MATRIX_COLS; j++) {
-      outbox.payload[2 + j] = matrix[idx++] & 0xff;
+      outbox.payload[2 + j] = baseline[idx++] >> BASELINE_FRACTION_BITS;
+    }
+    usb_send_c2();
+    return;
+  }
+  outbox.response_type = C2RESPONSE_MATRIX_TELEMETRY;
+  uint8_t pos = 1;
+  uint8_t records = 0;
+  while (records < MATRIX_ROWS) {
+    uint8_t size = pack_telemetry_row(telemetry_row, &outbox.payload[pos],
+                                      sizeof(outbox.payload) - pos);
+    if (size == 0) {
+      break;
+    }
+    pos += size;
+    records++;
+    if (++telemetry_row == MATRIX_ROWS) {
+      telemetry_row = 0;
+      if (++telemetry_passes == MATRIX_TELEMETRY_KEYFRAME_PASSES) {
+        // Resync in case host missed something.
+        telemetry_passes = 0;
+        telemetry_keyframe_rows = 0xffffffff;
+      }
     }
-    usb_send_c2_blocking();
   }
+  outbox.payload[0] = records;
+  usb_send_c2();
 }
@@ -10,12 +10,10 @@
 #pragma once
 #include "globals.h"
 
-typedef union {
-  struct {
-    uint8_t flags;
-    uint8_t scancode;
-  } __attribute__((packed));
-  uint8_t raw[2];
+typedef struct {
+  uint64_t time; // timestamp_us() when the event was detected
+  uint8_t flags;
+  uint8_t scancode;
 } scancode_t;
 
 // IMPORTANT - MUST NOT BE A REAL KEY!
@@ -32,11 +30,32 @@ typedef union {
 #define SANITY_CHECK_DURATION 1000
 #define SCANNER_INSANITY_THRESHOLD 3
 
-// This is to ease calculations, there are things hardcoded in buffer
-// management!! For 1 and 2 ADCs, that is.
+// SAR ADCs reading the row in parallel. config.h may set NUM_ADCs and
+// ADCn_COLUMNS - split doesn't have to be even. ADC0 gets the highest columns.
+// Each ADC's columns sit on the first MUX inputs PTK walks through.
+#ifndef NUM_ADCs
 #define NUM_ADCs 1
-
-#define ADC_CHANNELS (MATRIX_COLS / NUM_ADCs)
+#endif
+#if NUM_ADCs > 2
+#error PSoC 5LP only has two SAR ADCs
+#endif
+#ifndef ADC0_COLUMNS
+#define ADC0_COLUMNS (MATRIX_COLS - MATRIX_COLS / NUM_ADCs * (NUM_ADCs - 1))
+#endif
+#if NUM_ADCs == 1
+#define ADC_CHANNELS ADC0_COLUMNS
+#else
+#ifndef ADC1_COLUMNS
+#define ADC1_COLUMNS (MATRIX_COLS - ADC0_COLUMNS)
+#endif
+// PTK drives all MUXes at once, so the longest ADC sets the pace.
+#define ADC_CHANNELS                                                           \
+  (ADC0_COLUMNS > ADC1_COLUMNS ? ADC0_COLUMNS : ADC1_COLUMNS)
+#endif
+#if (NUM_ADCs == 1 && ADC0_COLUMNS != MATRIX_COLS) ||                          \
+    (NUM_ADCs == 2 && ADC0_COLUMNS + ADC1_COLUMNS != MATRIX_COLS)
+#error ADC column counts must add up to MATRIX_COLS
+#endif
 
 // Should be [number of columns per ADC + 1] * 2 + 1 - so 19 for MF, 27 for BS
 // TRICKY PART: Count7(which is part of PTK) counts down.
@@ -52,12 +71,42 @@ typedef union {
 // Below is per ADC.
 #define ADC_BUFFER_BYTESIZE (PTK_CHANNELS * 2)
 
+// FinalBuf DMA fills one Results row while Result_ISR works on the other.
+#define RESULT_SLOTS 2
+
 // Don't forget to set PTK to 5 channels for 100kHz mode!
 // 3 channels is too low - pulse reset logic activates at ch2 selection
 // Not good, 2 being the first channel in 3-channel config!
 // PTK calibration: 5 = 114kHz, 7 - 92kHz, 15 - 52kHz
 #undef COMMONSENSE_100KHZ_MODE
 
+/*
+ * USB frame phase, counted in EoC rows. USBFS SOF interrupt notes the row
+ * count, so it needs the component's SOF interrupt enabled - without it
+ * phase is not tracked. Target for the last pass of a frame is
+ * SOF_ALIGN_GUARD_US before next SOF - time for Result_ISR and pipeline to
+ * load the report. Without SOF for SOF_STALE_FRAMES (suspend, no host)
+ * phase is not tracked either.
+ */
+#define USB_FRAME_US 1000
+#define SOF_ALIGN_GUARD_US 50
+#define SOF_STALE_FRAMES 3
+void USB_SOF_ISR_EntryCallback(void);
+
+// Bit-planes per debouncing counter. Must hold MAX_DEBOUNCING_BUFFER_SIZE - 1.
+#define DEBOUNCING_COUNTER_BITS 4
+// Bit-planes for eager press lockout counter. Must hold uint8_t.
+#define LOCKOUT_COUNTER_BITS 8
+
+// Adaptive thresholds. Baseline is fixed point, IIR is 1/2^SHIFT per pass.
+#define BASELINE_FRACTION_BITS 8
+#define BASELINE_IIR_SHIFT 7
+
+// Matrix telemetry. All rows go out absolute every KEYFRAME_PASSES passes,
+// one baseline row replaces a telemetry packet every BASELINE_MASK+1 ticks.
+#define MATRIX_TELEMETRY_KEYFRAME_PASSES 32
+#define MATRIX_TELEMETRY_BASELINE_MASK 0x0f
+
 #define SCANCODE_BUFFER_END 31
 #define SCANCODE_BUFFER_NEXT(X) ((X + 1) & SCANCODE_BUFFER_END)
 // ^^^ THIS MUST EQUAL 2^n-1!!! Used as bitmask.
@@ -71,6 +120,9 @@ uint8_t level_buffer_inst[SCANCODE_BUFFER_END + 1];
 uint8_t scancode_buffer_writepos;
 uint8_t scancode_buffer_readpos;
 
+// Eager presses released on the very next sample. Reset on apply_config.
+uint32_t eager_glitches;
+
 void scan_init(uint8_t);
 void scan_start(void);
 void scan_reset(void);
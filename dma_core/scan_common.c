@@ -20,8 +20,10 @@ inline void append_scancode(uint8_t flags, uint8_t scancode) {
   }
 #endif
   scancode_buffer_writepos = SCANCODE_BUFFER_NEXT(scancode_buffer_writepos);
+  scancode_buffer[scancode_buffer_writepos].time = timestamp_us();
   scancode_buffer[scancode_buffer_writepos].flags = flags;
   scancode_buffer[scancode_buffer_writepos].scancode = scancode;
+  pipeline_pending = true;
   uint8_t row = scancode >> 5; // uint32 holds 32 values
   uint8_t col = scancode & 0x1f; // 0 to 31
   if (flags & KEY_UP_MASK) {
@@ -10,12 +10,10 @@
 #pragma once
 #include "globals.h"
 
-typedef union {
-  struct {
-    uint8_t flags;
-    uint8_t scancode;
-  } __attribute__((packed));
-  uint8_t raw[2];
+typedef struct {
+  uint64_t time; // timestamp_us() when the event was detected
+  uint8_t flags;
+  uint8_t scancode;
 } scancode_t;
 
 // IMPORTANT - MUST NOT BE A REAL KEY! Easy for beamspring, less so for F122
@@ -177,10 +177,10 @@ void scan_tick(void) {
         break;
     }
   } else if (codes.key1 == 0xFF) {
-    xprintf("ADB Error: received %x", codes.raw);
+    LOG(LOG_ADB_ERROR, codes.raw);
     return;
   } else {
-    xprintf("%02x %02x", codes.key0, codes.key1);
+    LOG(LOG_ADB_CODES, codes.key0, codes.key1);
     append_scancode(codes.key1 & KEY_UP_MASK, (codes.key1 & SCANCODE_MASK));
     if (codes.key0 != 0xFF) {
       append_scancode(codes.key0 & KEY_UP_MASK, (codes.key0 & SCANCODE_MASK));
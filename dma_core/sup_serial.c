@@ -81,10 +81,3 @@ void update_serial_keyboard_report(queuedScancode *key) {
   queue_ble_command(&buffer);
   //xprintf("%d %d %d %d", SCQueueReadPos, SCQueueWritePos, SCQueue[SCQueueWritePos].command, SCQueue[SCQueueWritePos].data);
 }
-
-void serial_reset_reports() {
-  Sup_Pdu_t buffer;
-  buffer.command = SUP_CMD_CLEAR;
-  buffer.data = 0;
-  queue_ble_command(&buffer);
-}
@@ -0,0 +1,154 @@
+/*
+ *
+ * Copyright (C) 2016-2017 DMA <dma@ya.ru>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * Feeds random bouncing input through Result_ISR and checks the events
+ * against the 16-bit shift register debouncer scan.c used to have.
+ * Every debouncingTicks value. Now and then two TERMOUTs coalesce into one
+ * Result_ISR.
+ */
+#include "../scan.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define TRIALS 50
+#define PASSES 200
+
+/*
+ * Reference: per-key history shifted left every sample, top bits forced to 1.
+ * Key goes down when history reads 0..01, up when it reads 1..10.
+ */
+static uint16_t ref_history[COMMONSENSE_MATRIX_SIZE];
+static uint32_t ref_status[MATRIX_ROWS];
+static uint16_t ref_mask, ref_posedge, ref_negedge;
+
+static scancode_t ref_events[MATRIX_COLS * RESULT_SLOTS];
+static uint8_t ref_count;
+
+static void ref_init(uint8_t ticks) {
+  ref_mask = 0xffff << ticks;
+  ref_negedge = (1 << (ticks - 1)) | ref_mask;
+  ref_posedge = ~(1 << (ticks - 1)) | ref_mask;
+  for (uint8_t i = 0; i < COMMONSENSE_MATRIX_SIZE; i++) {
+    ref_history[i] = NORMALLY_LOW ? 0 : 0xffff;
+  }
+  memset(ref_status, 0, sizeof(ref_status));
+  ref_count = 0;
+}
+
+static void ref_row(uint8_t row, uint32_t samples) {
+  for (int8_t col = MATRIX_COLS - 1; col >= 0; col--) {
+    uint8_t key = row * MATRIX_COLS + col;
+    bool down = ref_status[row] & (1 << col);
+    ref_history[key] = ((ref_history[key] << 1) | ref_mask) +
+                       ((samples >> col) & 1);
+    if (ref_history[key] == ref_posedge && !down) {
+      ref_status[row] |= 1 << col;
+      ref_events[ref_count].flags = 0;
+      ref_events[ref_count++].scancode = key;
+    } else if (ref_history[key] == ref_negedge && down) {
+      ref_status[row] &= ~(1 << col);
+      ref_events[ref_count].flags = KEY_UP_MASK;
+      ref_events[ref_count++].scancode = key;
+    }
+  }
+}
+
+// Key events Result_ISR queued since last call. NOKEY markers are skipped.
+static uint8_t drain(scancode_t *out) {
+  uint8_t count = 0;
+  while (scancode_buffer_readpos != scancode_buffer_writepos) {
+    scancode_buffer_readpos = SCANCODE_BUFFER_NEXT(scancode_buffer_readpos);
+    scancode_t *sc = &scancode_buffer[scancode_buffer_readpos];
+    if (sc->scancode != COMMONSENSE_NOKEY) {
+      out[count++] = *sc;
+    }
+    sc->flags = 0;
+    sc->scancode = COMMONSENSE_NOKEY;
+  }
+  return count;
+}
+
+static void row_levels(uint8_t row, bool *key_down, uint8_t *results,
+                       uint32_t *samples, uint8_t flip_rate) {
+  *samples = 0;
+  for (uint8_t col = 0; col < MATRIX_COLS; col++) {
+    uint8_t key = row * MATRIX_COLS + col;
+    if (rand() % flip_rate == 0) {
+      key_down[key] = !key_down[key];
+    }
+    bool sample = key_down[key] ^ (rand() % 7 == 0); // contact bounce
+    if (sample) {
+      *samples |= 1 << col;
+    }
+    results[column_offset[col]] =
+        (sample == NORMALLY_LOW) ? 200 : 10; // thresholds are 100
+  }
+}
+
+// Returns number of mismatching Result_ISR calls.
+static uint32_t run(uint8_t ticks, uint32_t *compared) {
+  uint32_t failures = 0;
+  memset(&config, 0, sizeof(config));
+  memset(config.thresholds, 100, sizeof(config.thresholds));
+  init_sensor(ticks);
+  ResultBufferSetup();
+  SET_BIT(status_register, C2DEVSTATUS_OUTPUT_ENABLED);
+  // Ticks of 1 never worked in the old engine, it's the same as 2 now.
+  ref_init(ticks < 2 ? 2 : ticks);
+  bool key_down[COMMONSENSE_MATRIX_SIZE] = {0};
+  for (uint16_t trial = 0; trial < TRIALS; trial++) {
+    uint8_t flip_rate = rand() % 20 + 1;
+    for (uint16_t pass = 0; pass < PASSES; pass++) {
+      for (int8_t row = MATRIX_ROWS - 1; row >= 0; row--) {
+        uint32_t samples;
+        row_levels(row, key_down, Results[eoc_slot], &samples, flip_rate);
+        ref_row(row, samples);
+        slot_row[eoc_slot] = row;
+        eoc_slot = (eoc_slot + 1) % RESULT_SLOTS;
+        eoc_rows++;
+        if ((uint16_t)(eoc_rows - result_rows) < RESULT_SLOTS &&
+            rand() % 5 == 0) {
+          continue; // Next TERMOUT arrives before this one is serviced.
+        }
+        Result_ISR();
+        scancode_t got[sizeof(ref_events) / sizeof(ref_events[0])];
+        uint8_t count = drain(got);
+        // Scancode buffer only holds so much - can't compare an overflow.
+        if (ref_count < SCANCODE_BUFFER_END) {
+          (*compared)++;
+          bool same = count == ref_count;
+          for (uint8_t i = 0; same && i < count; i++) {
+            same = got[i].flags == ref_events[i].flags &&
+                   got[i].scancode == ref_events[i].scancode;
+          }
+          if (!same && failures++ < 5) {
+            printf("ticks %d: trial %d pass %d row %d: %d events, "
+                   "expected %d\n",
+                   ticks, trial, pass, row, count, ref_count);
+          }
+        }
+        ref_count = 0;
+      }
+    }
+  }
+  return failures;
+}
+
+int main(void) {
+  uint32_t failures = 0;
+  uint32_t compared = 0;
+  srand(1);
+  for (uint8_t ticks = 1; ticks <= MAX_DEBOUNCING_BUFFER_SIZE; ticks++) {
+    failures += run(ticks, &compared);
+  }
+  printf("debounce: %u interrupts compared, %u mismatches\n", compared, failures);
+  return failures != 0;
+}
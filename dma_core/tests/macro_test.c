@@ -0,0 +1,150 @@
+/*
+ *
+ * Copyright (C) 2016-2017 DMA <dma@ya.ru>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * Checks lookup_macro() against the linear walk over config.macros it
+ * replaced, for every keycode and direction on random macro blobs, and
+ * prints how long both take. Then plays a macro that has another one right
+ * after it, which must stop at its own end.
+ */
+#include "../pipeline.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BLOBS 200
+#define BENCH_ROUNDS 200
+
+/*
+ * lookup_macro before the index. Verbatim, except for the empty check: the
+ * walk took erased flash at offset 0 for a key-up macro on keycode 0xff.
+ */
+static uint_fast16_t walk_macro(uint8_t flags, uint8_t keycode) {
+  uint_fast16_t ptr = 0;
+  if (config.macros[0] == EMPTY_FLASH_BYTE) {
+    return MACRO_NOT_FOUND;
+  }
+  do {
+    if (config.macros[ptr] == keycode &&
+        (flags & USBQUEUE_RELEASED_MASK) ==
+            (config.macros[ptr + 1] & MACRO_TYPE_ONKEYUP)) {
+      return ptr;
+    } else {
+      ptr += config.macros[ptr + 2] + 3;
+    }
+  } while (ptr < sizeof config.macros &&
+           config.macros[ptr] != EMPTY_FLASH_BYTE);
+  return MACRO_NOT_FOUND;
+}
+
+/*
+ * Random macros until count or the space runs out. Keycodes come from a
+ * narrow range now and then, so the same key gets several macros.
+ */
+static uint16_t random_blob(uint16_t count) {
+  uint16_t macros = 0;
+  uint16_t ptr = 0;
+  memset(config.macros, EMPTY_FLASH_BYTE, sizeof config.macros);
+  for (; macros < count; macros++) {
+    uint8_t len = rand() % 12;
+    if (ptr + 3 + len >= sizeof config.macros) {
+      break;
+    }
+    config.macros[ptr] = (rand() % 4) ? rand() % 0xff : 0x04 + rand() % 4;
+    config.macros[ptr + 1] = (rand() % 2) ? MACRO_TYPE_ONKEYUP : 0;
+    config.macros[ptr + 2] = len;
+    for (uint8_t i = 0; i < len; i++) {
+      config.macros[ptr + 3 + i] = rand();
+    }
+    ptr += 3 + len;
+  }
+  return macros;
+}
+
+static double ns_per_lookup(uint_fast16_t (*lookup)(uint8_t, uint8_t)) {
+  volatile uint_fast16_t sink;
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (uint16_t round = 0; round < BENCH_ROUNDS; round++) {
+    for (uint16_t keycode = 0; keycode < 0x100; keycode++) {
+      sink = lookup(0, keycode);
+      sink = lookup(USBQUEUE_RELEASED_MASK, keycode);
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  (void)sink;
+  return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) /
+         (BENCH_ROUNDS * 0x200);
+}
+
+/*
+ * Two TypeOneKey macros back to back. Playing the first must queue its
+ * press and release only - not run the second one's header as commands.
+ */
+static uint32_t adjacent_macros(void) {
+  static const uint8_t blob[] = {0x05, 0, 2, 0x00, 0x10,
+                                 0x06, 0, 2, 0x00, 0x11};
+  memset(config.macros, EMPTY_FLASH_BYTE, sizeof config.macros);
+  memcpy(config.macros, blob, sizeof blob);
+  config.delayLib[0] = 0;
+  index_macros();
+  USBQueue_count = 0;
+  memset(macro_contexts, 0, sizeof macro_contexts);
+  play_macro(lookup_macro(0, 0x05));
+  for (uint8_t i = 0; i < 8 && macro_contexts[0].active; i++) {
+    macro_step(&macro_contexts[0]);
+  }
+  uint8_t want[] = {0x10, 0x10};
+  uint32_t failures = 0;
+  if (macro_contexts[0].active || USBQueue_count != sizeof want) {
+    printf("adjacent macros: %d events queued%s, expected %d\n",
+           USBQueue_count, macro_contexts[0].active ? ", still active" : "",
+           (int)sizeof want);
+    return 1;
+  }
+  for (uint8_t i = 0; i < USBQueue_count; i++) {
+    if (USBQueue[i].event.keycode != want[i]) {
+      printf("adjacent macros: event %d is %02x, expected %02x\n", i,
+             USBQueue[i].event.keycode, want[i]);
+      failures++;
+    }
+  }
+  return failures;
+}
+
+int main(void) {
+  uint32_t failures = 0;
+  srand(1);
+  for (uint16_t blob = 0; blob < BLOBS; blob++) {
+    uint16_t count = random_blob(rand() % 120);
+    index_macros();
+    for (uint16_t keycode = 0; keycode < 0x100; keycode++) {
+      for (uint8_t up = 0; up < 2; up++) {
+        uint8_t flags = up ? USBQUEUE_RELEASED_MASK : 0;
+        uint_fast16_t want = walk_macro(flags, keycode);
+        uint_fast16_t got = lookup_macro(flags, keycode);
+        if (got != want && failures++ < 5) {
+          printf("blob %d (%d macros), key %02x%s: %d, expected %d\n", blob,
+                 count, keycode, up ? " up" : "", (int)got, (int)want);
+        }
+      }
+    }
+  }
+  static const uint16_t bench_counts[] = {3, 20, 60, 120};
+  for (uint8_t i = 0; i < sizeof bench_counts / sizeof bench_counts[0]; i++) {
+    uint16_t count = random_blob(bench_counts[i]);
+    index_macros();
+    printf("macro: %3d macros: walk %6.1f ns, index %5.1f ns per lookup\n",
+           count, ns_per_lookup(walk_macro), ns_per_lookup(lookup_macro));
+  }
+  printf("macro: %d blobs checked, %u mismatches\n", BLOBS, failures);
+  failures += adjacent_macros();
+  return failures != 0;
+}
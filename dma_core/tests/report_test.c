@@ -0,0 +1,177 @@
+/*
+ *
+ * Copyright (C) 2016-2017 DMA <dma@ya.ru>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * Plays key updates into PSoC_USB.c between endpoint polls and checks what
+ * the host gets. Like pipeline, holds an update while the key's last change
+ * is unsent. A tap inside one poll interval must still arrive as a press and
+ * a release; changes to different keys share a report.
+ */
+#include "../PSoC_USB.c"
+
+#include <stdio.h>
+
+static uint8_t protocol = USB_PROTOCOL_REPORT;
+int USB_GetProtocol(int interface) { return protocol; }
+int USB_GetConfiguration(void) { return 1; }
+
+// Endpoint is free only when the test polls it.
+static bool ep_free[OUTBOX_EP + 1];
+int USB_GetEPState(int ep) {
+  return ep_free[ep] ? USB_IN_BUFFER_EMPTY : USB_IN_BUFFER_FULL;
+}
+
+#define MAX_SENT 16
+static uint8_t sent[MAX_SENT][sizeof keyboard_report.raw];
+static uint8_t sent_len[MAX_SENT];
+static uint8_t sent_count;
+int USB_LoadInEP(int ep, uint8_t *data, int len) {
+  ep_free[ep] = false;
+  if (sent_count < MAX_SENT) {
+    memcpy(sent[sent_count], data, len);
+    sent_len[sent_count] = len;
+  }
+  sent_count++;
+  return 0;
+}
+
+// One host poll of ep.
+static void poll(uint8_t ep) {
+  ep_free[ep] = true;
+  usbSend();
+}
+
+// Host polls ep until nothing is left.
+static void flush(uint8_t ep) {
+  do {
+    poll(ep);
+  } while (!ep_free[ep]);
+}
+
+static void key(void (*update)(queuedScancode *), uint8_t ep, uint8_t keycode,
+                bool release) {
+  while (usb_usage_unsent(keycode)) {
+    poll(ep);
+  }
+  queuedScancode k = {0};
+  k.keycode = keycode;
+  k.flags = release ? USBQUEUE_RELEASED_MASK : 0;
+  update(&k);
+}
+
+static uint32_t failures;
+
+// Checks reports since the last call.
+static void expect(const char *what, uint8_t count, ...) {
+  va_list ap;
+  va_start(ap, count);
+  bool same = sent_count == count;
+  for (uint8_t i = 0; same && i < count; i++) {
+    uint8_t *want = va_arg(ap, uint8_t *);
+    same = memcmp(sent[i], want, sent_len[i]) == 0;
+  }
+  va_end(ap);
+  if (!same) {
+    failures++;
+    printf("report: %s: %d reports, expected %d\n", what, sent_count, count);
+  }
+  sent_count = 0;
+}
+
+#define KBD(KEYCODE, RELEASE)                                                  \
+  key(update_keyboard_report, KBD_EP, KEYCODE, RELEASE)
+
+int main(void) {
+  usb_configure();
+  static uint8_t none[sizeof keyboard_report.raw];
+  uint8_t a[sizeof keyboard_report.raw] = {0};
+  uint8_t b[sizeof keyboard_report.raw] = {0};
+  uint8_t ab[sizeof keyboard_report.raw] = {0};
+  a[2 + USBCODE_A / 8] = 1 << (USBCODE_A % 8);
+  b[2 + (USBCODE_A + 1) / 8] = 1 << ((USBCODE_A + 1) % 8);
+  for (uint8_t i = 0; i < sizeof ab; i++) {
+    ab[i] = a[i] | b[i];
+  }
+
+  KBD(USBCODE_A, false);
+  KBD(USBCODE_A, true);
+  flush(KBD_EP);
+  expect("tap", 2, a, none);
+
+  KBD(USBCODE_A, false);
+  KBD(USBCODE_A + 1, false);
+  flush(KBD_EP);
+  expect("two presses", 1, ab);
+
+  KBD(USBCODE_A + 1, true);
+  KBD(USBCODE_A, true);
+  flush(KBD_EP);
+  expect("two releases", 1, none);
+
+  // Release of a key host already has down merges with the next change.
+  KBD(USBCODE_A, false);
+  flush(KBD_EP);
+  sent_count = 0;
+  KBD(USBCODE_A, true);
+  KBD(USBCODE_A + 1, false);
+  KBD(USBCODE_A + 1, true);
+  flush(KBD_EP);
+  expect("release, tap", 2, b, none);
+
+  // Update that leaves the state as host has it doesn't load the endpoint.
+  KBD(USBCODE_A, false);
+  flush(KBD_EP);
+  sent_count = 0;
+  KBD(USBCODE_A, false);
+  flush(KBD_EP);
+  expect("no change", 0);
+  KBD(USBCODE_A, true);
+  flush(KBD_EP);
+  sent_count = 0;
+
+  for (uint8_t i = 0; i < 4; i++) {
+    KBD(USBCODE_A, false);
+    KBD(USBCODE_A, true);
+  }
+  flush(KBD_EP);
+  expect("taps", 8, a, none, a, none, a, none, a, none);
+
+  protocol = USB_PROTOCOL_BOOT;
+  KBD(USBCODE_A, false);
+  KBD(USBCODE_A, true);
+  flush(KBD_EP);
+  uint8_t boot_a[KBD_BOOT_REPORT_SIZE] = {0, 0, USBCODE_A};
+  expect("boot tap", 2, boot_a, none);
+  protocol = USB_PROTOCOL_REPORT;
+
+  key(update_consumer_report, CONSUMER_EP, 0xe8 + 2, false); // Vol++
+  key(update_consumer_report, CONSUMER_EP, 0xe8 + 2, true);
+  flush(CONSUMER_EP);
+  uint8_t volume_up[OUTBOX_SIZE(CONSUMER_OUTBOX)] = {0xe9};
+  expect("consumer tap", 2, volume_up, none);
+
+  key(update_system_report, SYSTEM_EP, 0xa5, false);
+  key(update_system_report, SYSTEM_EP, 0xa5, true);
+  flush(SYSTEM_EP);
+  uint8_t power[OUTBOX_SIZE(SYSTEM_OUTBOX)] = {1};
+  expect("system tap", 2, power, none);
+
+  // Reconfigured host has nothing - unsent state is dropped, not held.
+  KBD(USBCODE_A, false);
+  usb_configure();
+  if (usb_usage_unsent(USBCODE_A)) {
+    failures++;
+    printf("report: configure: key still unsent\n");
+  }
+  flush(KBD_EP);
+  expect("configure", 0);
+
+  printf("report: %u failures\n", failures);
+  return failures != 0;
+}
@@ -0,0 +1,199 @@
+/*
+ *
+ * Copyright (C) 2016-2017 DMA <dma@ya.ru>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * Host stand-in for the PSoC Creator generated project.h. Just enough of the
+ * Cypress API for dma_core to compile; functions are weak stubs in stubs.c
+ * and tests override whatever they need to observe.
+ */
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef uint8_t uint8;
+typedef uint16_t uint16;
+typedef uint32_t uint32;
+typedef volatile uint8_t reg8;
+typedef volatile uint32_t reg32;
+
+#define CY_ISR(n) void n(void)
+#define CY_ISR_PROTO(n) void n(void)
+typedef struct {
+  uint8_t status;
+} USB_hid_scb_t;
+
+#define LO16(x) ((uint16)(x))
+#define HI16(x) ((uint16)((x) >> 16))
+
+// scan.c keeps these in a typed table.
+void ADC0_Start(void);
+void ADC0_SetResolution(uint8 resolution);
+void ADC0_Sleep(void);
+void ADC0_Wakeup(void);
+uint8 Buf0_DmaInitialize(uint8 burstCount, uint8 requestPerBurst,
+                         uint16 upperSrcAddress, uint16 upperDestAddress);
+
+int BootIRQ_StartEx();
+int Boot_Load();
+int ChargeDelay_Sleep();
+int ChargeDelay_Start();
+int ChargeDelay_Wakeup();
+int ChargeDelay_WritePeriod();
+int CyDelay();
+int CyDelayUs();
+int CyDmaChDisable();
+int CyDmaChEnable();
+int CyDmaChSetInitialTd();
+int CyDmaChGetRequest();
+int CyDmaChSetRequest();
+int CyDmaClearPendingDrq();
+int CyDmaTdAllocate();
+int CyDmaTdSetAddress();
+int CyDmaTdSetConfiguration();
+int CyEEPROM_ReadRelease();
+int CyEEPROM_ReadReserve();
+int CyEnterCriticalSection();
+int CyExitCriticalSection();
+int CyPins_ClearPin();
+int CyPins_SetPin();
+int CyPmAltAct();
+int CyPmRestoreClocks();
+int CyPmSaveClocks();
+int CyPmSleep();
+int CySoftwareReset();
+int CySysTickGetReload();
+int CySysTickGetValue();
+int CySysTickSetCallback();
+int CySysTickStart();
+int DischargeDelay_Sleep();
+int DischargeDelay_Start();
+int DischargeDelay_Wakeup();
+int DischargeDelay_WritePeriod();
+int DriveReg0_Write();
+int EEPROM_ReadByte();
+int EEPROM_Start();
+int EEPROM_Stop();
+int EEPROM_UpdateTemperature();
+int EEPROM_Write();
+int EEPROM_WriteByte();
+int EoCIRQ_SetPriority();
+int EoCIRQ_StartEx();
+int FinalBuf_DmaInitialize();
+int ILO_Trim_BeginTrimming();
+int ILO_Trim_Start();
+int ResultIRQ_SetPriority();
+int ResultIRQ_StartEx();
+int Sup_I2C_SlaveClearReadBuf();
+int Sup_I2C_SlaveClearReadStatus();
+int Sup_I2C_SlaveClearWriteBuf();
+int Sup_I2C_SlaveClearWriteStatus();
+int Sup_I2C_SlaveGetReadBufSize();
+int Sup_I2C_SlaveGetWriteBufSize();
+int Sup_I2C_SlaveInitReadBuf();
+int Sup_I2C_SlaveInitWriteBuf();
+int Sup_I2C_SlaveStatus();
+int Sup_I2C_Sleep();
+int Sup_I2C_Start();
+int Sup_I2C_Wakeup();
+int SuspendWD_Start();
+int SuspendWD_Stop();
+int SuspendWD_WriteCounter();
+int SysTimer_Sleep();
+int SysTimer_Start();
+int SysTimer_Wakeup();
+int TimerIRQ_StartEx();
+int USBSuspendIRQ_StartEx();
+int USBSuspendIRQ_Stop();
+int USB_Force();
+int USB_GetConfiguration();
+int USB_GetEPState();
+int USB_GetProtocol();
+int USB_IsConfigurationChanged();
+int USB_LoadInEP();
+int USB_RWUEnabled();
+int USB_Resume();
+int USB_Start();
+int USB_Suspend();
+
+// Registers the firmware dereferences directly.
+extern reg8 stub_reg[8];
+#define PTK_ChannelCounter__PERIOD_REG (&stub_reg[0])
+#define PTK_ChannelCounter__CONTROL_AUX_CTL_REG (&stub_reg[1])
+#define PTK_CtrlReg__CONTROL_REG (&stub_reg[2])
+#define USB_SOF0_REG (stub_reg[3])
+#define USB_Dp_PS (stub_reg[4])
+#define USB_Dp__MASK 0x01
+#define USB_Dm__MASK 0x02
+
+typedef struct {
+  volatile uint32_t ICSR;
+} SCB_Type;
+extern SCB_Type stub_scb;
+#define SCB (&stub_scb)
+#define SCB_ICSR_PENDSTSET_Msk (1UL << 26)
+
+#define ADC0_ADC_SAR__WRK0 0
+#define Buf0_DmaHandle 0
+#define Buf0__TD_TERMOUT_EN 0
+#define FinalBuf_DmaHandle 1
+#define FinalBuf__TD_TERMOUT_EN 0
+#define CY_DMA_CPU_REQ 0
+#define CY_DMA_INVALID_TD 0xff
+#define CY_DMA_TD_INC_DST_ADR 0
+#define CY_DMA_TD_INC_SRC_ADR 0
+#define CY_DMA_TD_AUTO_EXEC_NEXT 0
+#define TD_INC_DST_ADR 0
+#define EoCIRQ__INTC_PRIOR_NUM 0
+#define ResultIRQ__INTC_PRIOR_NUM 1
+
+#define CYDEV_EE_BASE 0
+#define CYDEV_EE_SIZE 0
+#define CYDEV_PERIPH_BASE 0
+#define CYDEV_SRAM_BASE 0
+#define CY_EEPROM_SIZEOF_ROW 16
+#define CYRET_SUCCESS 0
+#define CyGlobalIntEnable
+#define BCLK__BUS_CLK__HZ 36000000U
+
+#define ExpHdr_0 0
+#define ExpHdr_1 1
+#define ExpHdr_2 2
+#define ExpHdr_3 3
+#define HPWR_0 0
+
+#define PM_ALT_ACT_SRC_NONE 0
+#define PM_ALT_ACT_TIME_NONE 0
+#define PM_SLEEP_SRC_I2C 0
+#define PM_SLEEP_SRC_PICU 0
+#define PM_SLEEP_TIME_NONE 0
+#define Sup_I2C_SSTAT_RD_CMPLT 0x01
+#define Sup_I2C_SSTAT_WR_CMPLT 0x02
+
+#define USB_5V_OPERATION 0
+#define USB_FORCE_NONE 0
+#define USB_FORCE_K 1
+#define USB_IN_BUFFER_FULL 0
+#define USB_IN_BUFFER_EMPTY 1
+#define USB_PROTOCOL_BOOT 0
+#define USB_PROTOCOL_REPORT 1
+#define USB_XFER_IDLE 0
+#define USB_XFER_STATUS_ACK 1
+
+extern uint8_t USB_DEVICE0_CONFIGURATION0_INTERFACE0_ALTERNATE0_HID_IN_BUF[65];
+extern uint8_t USB_DEVICE0_CONFIGURATION0_INTERFACE0_ALTERNATE0_HID_OUT_BUF[2];
+extern USB_hid_scb_t
+    USB_DEVICE0_CONFIGURATION0_INTERFACE0_ALTERNATE0_HID_OUT_RPT_SCB;
+extern uint8_t USB_DEVICE0_CONFIGURATION0_INTERFACE1_ALTERNATE0_HID_OUT_BUF[65];
+extern USB_hid_scb_t
+    USB_DEVICE0_CONFIGURATION0_INTERFACE1_ALTERNATE0_HID_OUT_RPT_SCB;
+extern uint8_t USB_DEVICE0_CONFIGURATION0_INTERFACE2_ALTERNATE0_HID_IN_BUF[17];
+extern uint8_t USB_DEVICE0_CONFIGURATION0_INTERFACE3_ALTERNATE0_HID_IN_BUF[2];
+extern uint8_t dieTemperature[2];
+extern uint64_t stub_time_us;
@@ -0,0 +1,146 @@
+/*
+ *
+ * Copyright (C) 2016-2017 DMA <dma@ya.ru>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * Weak stand-ins for the Cypress API and for dma_core functions that live in
+ * modules a test doesn't include. A test defines its own version of anything
+ * it wants to drive or observe.
+ */
+#include "project.h"
+
+#define WEAK __attribute__((weak))
+#define STUB(NAME)                                                             \
+  WEAK int NAME() { return 0; }
+
+reg8 stub_reg[8];
+SCB_Type stub_scb;
+uint8_t USB_DEVICE0_CONFIGURATION0_INTERFACE0_ALTERNATE0_HID_IN_BUF[65];
+uint8_t USB_DEVICE0_CONFIGURATION0_INTERFACE0_ALTERNATE0_HID_OUT_BUF[2];
+USB_hid_scb_t USB_DEVICE0_CONFIGURATION0_INTERFACE0_ALTERNATE0_HID_OUT_RPT_SCB;
+uint8_t USB_DEVICE0_CONFIGURATION0_INTERFACE1_ALTERNATE0_HID_OUT_BUF[65];
+USB_hid_scb_t USB_DEVICE0_CONFIGURATION0_INTERFACE1_ALTERNATE0_HID_OUT_RPT_SCB;
+uint8_t USB_DEVICE0_CONFIGURATION0_INTERFACE2_ALTERNATE0_HID_IN_BUF[17];
+uint8_t USB_DEVICE0_CONFIGURATION0_INTERFACE3_ALTERNATE0_HID_IN_BUF[2];
+uint8_t dieTemperature[2];
+
+WEAK void ADC0_Start(void) {}
+WEAK void ADC0_SetResolution(uint8 resolution) {}
+WEAK void ADC0_Sleep(void) {}
+WEAK void ADC0_Wakeup(void) {}
+WEAK uint8 Buf0_DmaInitialize(uint8 burstCount, uint8 requestPerBurst,
+                              uint16 upperSrcAddress, uint16 upperDestAddress) {
+  return 0;
+}
+
+STUB(BootIRQ_StartEx)
+STUB(Boot_Load)
+STUB(ChargeDelay_Sleep)
+STUB(ChargeDelay_Start)
+STUB(ChargeDelay_Wakeup)
+STUB(ChargeDelay_WritePeriod)
+STUB(CyDelay)
+STUB(CyDelayUs)
+STUB(CyDmaChDisable)
+STUB(CyDmaChEnable)
+STUB(CyDmaChSetInitialTd)
+STUB(CyDmaChGetRequest)
+STUB(CyDmaChSetRequest)
+STUB(CyDmaClearPendingDrq)
+STUB(CyDmaTdAllocate)
+STUB(CyDmaTdSetAddress)
+STUB(CyDmaTdSetConfiguration)
+STUB(CyEEPROM_ReadRelease)
+STUB(CyEEPROM_ReadReserve)
+STUB(CyEnterCriticalSection)
+STUB(CyExitCriticalSection)
+STUB(CyPins_ClearPin)
+STUB(CyPins_SetPin)
+STUB(CyPmAltAct)
+STUB(CyPmRestoreClocks)
+STUB(CyPmSaveClocks)
+STUB(CyPmSleep)
+STUB(CySoftwareReset)
+STUB(CySysTickGetReload)
+STUB(CySysTickGetValue)
+STUB(CySysTickSetCallback)
+STUB(CySysTickStart)
+STUB(DischargeDelay_Sleep)
+STUB(DischargeDelay_Start)
+STUB(DischargeDelay_Wakeup)
+STUB(DischargeDelay_WritePeriod)
+STUB(DriveReg0_Write)
+STUB(EEPROM_ReadByte)
+STUB(EEPROM_Start)
+STUB(EEPROM_Stop)
+STUB(EEPROM_UpdateTemperature)
+STUB(EEPROM_Write)
+STUB(EEPROM_WriteByte)
+STUB(EoCIRQ_SetPriority)
+STUB(EoCIRQ_StartEx)
+STUB(FinalBuf_DmaInitialize)
+STUB(ILO_Trim_BeginTrimming)
+STUB(ILO_Trim_Start)
+STUB(ResultIRQ_SetPriority)
+STUB(ResultIRQ_StartEx)
+STUB(Sup_I2C_SlaveClearReadBuf)
+STUB(Sup_I2C_SlaveClearReadStatus)
+STUB(Sup_I2C_SlaveClearWriteBuf)
+STUB(Sup_I2C_SlaveClearWriteStatus)
+STUB(Sup_I2C_SlaveGetReadBufSize)
+STUB(Sup_I2C_SlaveGetWriteBufSize)
+STUB(Sup_I2C_SlaveInitReadBuf)
+STUB(Sup_I2C_SlaveInitWriteBuf)
+STUB(Sup_I2C_SlaveStatus)
+STUB(Sup_I2C_Sleep)
+STUB(Sup_I2C_Start)
+STUB(Sup_I2C_Wakeup)
+STUB(SuspendWD_Start)
+STUB(SuspendWD_Stop)
+STUB(SuspendWD_WriteCounter)
+STUB(SysTimer_Sleep)
+STUB(SysTimer_Start)
+STUB(SysTimer_Wakeup)
+STUB(TimerIRQ_StartEx)
+STUB(USBSuspendIRQ_StartEx)
+STUB(USBSuspendIRQ_Stop)
+STUB(USB_Force)
+STUB(USB_GetConfiguration)
+STUB(USB_GetEPState)
+STUB(USB_GetProtocol)
+STUB(USB_IsConfigurationChanged)
+STUB(USB_LoadInEP)
+STUB(USB_RWUEnabled)
+STUB(USB_Resume)
+STUB(USB_Start)
+STUB(USB_Suspend)
+
+// dma_core, for tests that don't include the module.
+uint64_t stub_time_us;
+WEAK uint64_t timestamp_us(void) { return stub_time_us; }
+WEAK uint32_t cycles_since(uint32_t started) { return 0; }
+WEAK void log_event(uint8_t argc, uint8_t id, ...) {}
+WEAK void usb_send_c2() {}
+WEAK void usb_send_c2_blocking() {}
+WEAK bool usb_c2_idle(void) { return true; }
+WEAK bool usb_usage_unsent(uint8_t keycode) { return false; }
+WEAK void latency_record(uint8_t stage, uint32_t us) {}
+WEAK void scan_init(uint8_t debouncing_period) {}
+WEAK void scan_start(void) {}
+WEAK void scan_reset(void) {}
+WEAK void pipeline_init(void) {}
+WEAK void exp_init(void) {}
+WEAK void exp_setLEDs(uint8_t status) {}
+WEAK void exp_keypress(uint8_t keycode) {}
+WEAK void exp_toggle(void) {}
+WEAK void update_keyboard_report(void *key) {}
+WEAK void update_consumer_report(void *key) {}
+WEAK void update_system_report(void *key) {}
+WEAK void update_serial_keyboard_report(void *key) {}
+WEAK void usb_hold_reports(void) {}
+WEAK void usb_release_reports(void) {}